@@ -0,0 +1,281 @@
+/*
+* ahtse_batch.cpp
+*
+* Batch tile requests, many tiles in one response
+*
+* The tile list comes from the tiles query parameter or from the request body, as comma or
+* white space separated L/R/C or M/L/R/C addresses. The response is multipart/mixed, one part
+* per tile in the requested order, each with the tile address, status and ETag. Parts are
+* sent as soon as they are ready
+* The empty tile body is sent only once, later empty tiles have the same ETag and no content
+*
+* (C) Lucian Plesea 2019-2021
+*
+*/
+
+#include "ahtse.h"
+#include <http_protocol.h>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include <string>
+
+using namespace std;
+NS_ICD_USE
+
+NS_AHTSE_START
+
+// Largest request body
+#define BATCH_MAX_BODY (64 * 1024)
+#define BATCH_BOUNDARY "ahtse-batch-3e5a1c"
+
+// Parses one address, 3 or 4 numbers separated by /
+static bool parse_tile(const char* s, sloc_t& tile) {
+    apr_uint64_t v[4];
+    int n = 0;
+    while (n < 4) {
+        char* end;
+        v[n++] = apr_strtoi64(s, &end, 10);
+        if (end == s)
+            return false;
+        s = end;
+        if ('/' != *s)
+            break;
+        s++;
+    }
+    if (*s || n < 3)
+        return false;
+    tile = sloc_t();
+    int i = 0;
+    if (4 == n)
+        tile.z = v[i++];
+    tile.l = v[i++];
+    tile.y = v[i++];
+    tile.x = v[i];
+    return true;
+}
+
+int get_tile_list(request_rec* r, vector<sloc_t>& tiles, size_t max_tiles) {
+    tiles.clear();
+    const char* list = nullptr;
+    apr_hash_t* args = argparse(r);
+    if (args)
+        list = static_cast<const char*>(apr_hash_get(args, "tiles", APR_HASH_KEY_STRING));
+
+    if (!list && !strcmp(r->method, "POST")) {
+        if (OK != ap_setup_client_block(r, REQUEST_CHUNKED_ERROR) || !ap_should_client_block(r))
+            return HTTP_BAD_REQUEST;
+        string body;
+        char buffer[4096];
+        long len;
+        while ((len = ap_get_client_block(r, buffer, sizeof(buffer))) > 0) {
+            body.append(buffer, len);
+            if (body.size() > BATCH_MAX_BODY)
+                return HTTP_REQUEST_ENTITY_TOO_LARGE;
+        }
+        if (len < 0)
+            return HTTP_BAD_REQUEST;
+        list = apr_pstrdup(r->pool, body.c_str());
+    }
+    if (!list)
+        return HTTP_BAD_REQUEST;
+
+    char* last;
+    char* s = apr_pstrdup(r->pool, list);
+    for (char* tok = apr_strtok(s, ", \t\r\n", &last); tok; tok = apr_strtok(nullptr, ", \t\r\n", &last)) {
+        sloc_t tile;
+        if (!parse_tile(tok, tile))
+            return HTTP_BAD_REQUEST;
+        if (tiles.size() == max_tiles)
+            return HTTP_REQUEST_ENTITY_TOO_LARGE;
+        tiles.push_back(tile);
+    }
+    return tiles.empty() ? HTTP_BAD_REQUEST : APR_SUCCESS;
+}
+
+// One tile of the batch, filled by the fetching thread
+struct batch_item_t {
+    batch_item_t() : ready(false), status(0) {}
+    bool ready;
+    int status;
+    vector<char> data;
+    string ETag;
+};
+
+static bool in_raster(const TiledRaster& raster, const sloc_t& tile) {
+    size_t level = static_cast<size_t>(tile.l) + raster.skip;
+    return level < raster.n_levels && tile.x < raster.rsets[level].w
+        && tile.y < raster.rsets[level].h && tile.z < raster.size.z;
+}
+
+static void send_part(request_rec* r, const sloc_t& tile, int status, const char* ETag,
+    const void* data, size_t size, bool empty)
+{
+    const char* mime = "application/octet-stream";
+    if (size >= 4) {
+        apr_uint32_t sig;
+        memcpy(&sig, data, 4);
+        if (JPEG_SIG == sig)
+            mime = "image/jpeg";
+        else if (PNG_SIG == sig)
+            mime = "image/png";
+    }
+    string head("--" BATCH_BOUNDARY "\r\n");
+    head.append(apr_psprintf(r->pool, "X-Tile: %" APR_UINT64_T_FMT "/%" APR_UINT64_T_FMT
+        "/%" APR_UINT64_T_FMT "/%" APR_UINT64_T_FMT "\r\nStatus: %d\r\n",
+        static_cast<apr_uint64_t>(tile.z), static_cast<apr_uint64_t>(tile.l),
+        static_cast<apr_uint64_t>(tile.y), static_cast<apr_uint64_t>(tile.x), status));
+    // Upstream ETags might already be quoted
+    string tag(ETag ? ETag : "");
+    if (tag.size() > 1 && '"' == tag.front() && '"' == tag.back())
+        tag = tag.substr(1, tag.size() - 2);
+    if (!tag.empty())
+        head.append("ETag: \"").append(tag).append("\"\r\n");
+    if (empty)
+        head.append("Content-Location: empty\r\n");
+    if (size)
+        head.append("Content-Type: ").append(mime).append("\r\n");
+    head.append(apr_psprintf(r->pool, "Content-Length: %" APR_SIZE_T_FMT "\r\n\r\n", size));
+    ap_rwrite(head.data(), static_cast<int>(head.size()), r);
+    if (size)
+        ap_rwrite(data, static_cast<int>(size), r);
+    ap_rwrite("\r\n", 2, r);
+}
+
+// A fetching thread, with its own pool, the request pool is not thread safe
+struct batch_lane_t {
+    request_rec r;
+    void* buffer;
+};
+
+int send_tile_batch(request_rec* r, const char* source, const char* suffix,
+    const TiledRaster& raster, const vector<sloc_t>& tiles, size_t concurrency)
+{
+    size_t n = tiles.size();
+    vector<batch_item_t> items(n);
+    mutex lock;
+    condition_variable cv;
+    vector<batch_lane_t> lanes;
+    size_t lanes_done = 0;
+    vector<string> urls;
+    atomic<size_t> next(0);
+
+    // Direct http:// sources are fetched on the worker threads, through get_response,
+    // subrequests only work on the request thread
+    if (is_http_url(source) && concurrency > 1 && n > 1) {
+        // The urls and the lanes are set up here
+        urls.resize(n);
+        for (size_t i = 0; i < n; i++)
+            urls[i] = pMLRC(r->pool, source, tiles[i], suffix);
+        lanes.resize(min(concurrency, n));
+        for (auto& lane : lanes) {
+            lane.r = *r;
+            lane.buffer = nullptr;
+            if (APR_SUCCESS == apr_pool_create(&lane.r.pool, nullptr))
+                lane.buffer = get_tile_buffer(lane.r.pool, raster.maxtilesize);
+            else
+                lane.r.pool = nullptr;
+        }
+
+        for (auto& lane : lanes) {
+            batch_lane_t* pl = &lane;
+            // Everything used here outlives the lane, the request thread waits for all
+            worker_submit([&, pl]() {
+                size_t i;
+                while ((i = next++) < n) {
+                    batch_item_t item;
+                    if (!in_raster(raster, tiles[i]))
+                        item.status = HTTP_BAD_REQUEST;
+                    else if (!pl->buffer)
+                        item.status = HTTP_INTERNAL_SERVER_ERROR;
+                    else {
+                        storage_manager dst(pl->buffer, raster.maxtilesize);
+                        char* sETag = nullptr;
+                        item.status = get_response(&pl->r, urls[i].c_str(), dst, &sETag);
+                        if (APR_SUCCESS == item.status) {
+                            item.status = HTTP_OK;
+                            const char* b = static_cast<const char*>(pl->buffer);
+                            item.data.assign(b, b + dst.size);
+                            if (sETag)
+                                item.ETag = sETag;
+                        }
+                    }
+                    lock_guard<mutex> guard(lock);
+                    items[i].status = item.status;
+                    items[i].data.swap(item.data);
+                    items[i].ETag.swap(item.ETag);
+                    items[i].ready = true;
+                    cv.notify_all();
+                }
+                lock_guard<mutex> guard(lock);
+                lanes_done++;
+                cv.notify_all();
+            });
+        }
+    }
+
+    ap_set_content_type(r, "multipart/mixed; boundary=" BATCH_BOUNDARY);
+    void* buffer = lanes.empty() ? get_tile_buffer(r->pool, raster.maxtilesize) : nullptr;
+    bool empty_sent = false;
+    for (size_t i = 0; i < n; i++) {
+        int status;
+        const char* ETag = nullptr;
+        storage_manager content(nullptr, 0);
+        if (!lanes.empty()) {
+            unique_lock<mutex> guard(lock);
+            cv.wait(guard, [&items, i]() { return items[i].ready; });
+            status = items[i].status;
+            ETag = items[i].ETag.c_str();
+            content = storage_manager(items[i].data.data(), items[i].data.size());
+        }
+        else if (!in_raster(raster, tiles[i]) || !buffer) {
+            status = buffer ? HTTP_BAD_REQUEST : HTTP_INTERNAL_SERVER_ERROR;
+        }
+        else {
+            content = storage_manager(buffer, raster.maxtilesize);
+            char* sETag = nullptr;
+            status = get_remote_tile(r, source, tiles[i], content, &sETag, suffix);
+            if (APR_SUCCESS == status)
+                status = HTTP_OK;
+            else
+                content.size = 0;
+            ETag = sETag;
+        }
+        if (HTTP_OK != status)
+            content.size = 0;
+
+        // Missing tiles and empty tiles are sent as references to the empty tile
+        int missing = 0;
+        if (ETag && *ETag)
+            base32decode(ETag, &missing);
+        if (HTTP_NOT_FOUND == status || missing) {
+            status = HTTP_OK;
+            ETag = raster.missing.eTag;
+            content = empty_sent ? storage_manager(nullptr, 0) : raster.missing.data;
+            empty_sent = true;
+            send_part(r, tiles[i], status, ETag, content.buffer, content.size, true);
+        }
+        else
+            send_part(r, tiles[i], status, ETag, content.buffer, content.size, false);
+        ap_rflush(r);
+    }
+    string tail("--" BATCH_BOUNDARY "--\r\n");
+    ap_rwrite(tail.data(), static_cast<int>(tail.size()), r);
+
+    if (!lanes.empty()) {
+        unique_lock<mutex> guard(lock);
+        cv.wait(guard, [&]() { return lanes_done == lanes.size(); });
+    }
+    for (auto& lane : lanes) {
+        if (!lane.r.pool)
+            continue;
+        release_tile_buffer(lane.r.pool, lane.buffer);
+        apr_pool_destroy(lane.r.pool);
+    }
+    if (buffer)
+        release_tile_buffer(r->pool, buffer);
+    return OK;
+}
+
+NS_AHTSE_END
@@ -0,0 +1,202 @@
+/*
+* ahtse_breaker.cpp
+*
+* Per source health tracking and circuit breaker
+*
+* Each source keeps request, error and slow request counts over a sliding window of
+* one second buckets. When the error or slow fraction reaches the threshold the breaker
+* opens and requests fail right away. After the open time a single probe request is let
+* through, half open, which closes the breaker if it works and opens it again otherwise.
+* Only the probe outcome changes the half open state
+* The sources are kept in sharded maps, when the breaker is disabled no lock is taken
+*
+* (C) Lucian Plesea 2019-2021
+*
+*/
+
+#include "ahtse.h"
+#include <httpd.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <memory>
+#include <atomic>
+#include <functional>
+
+using namespace std;
+NS_ICD_USE
+
+NS_AHTSE_START
+
+// Window length, in one second buckets
+#define BR_BUCKETS 10
+
+enum br_state_t { BR_CLOSED = 0, BR_OPEN, BR_HALF_OPEN };
+
+struct br_bucket_t {
+    apr_time_t sec;
+    apr_uint32_t total, errors, slow;
+};
+
+struct source_health_t {
+    source_health_t(const breaker_conf_t& conf) : conf(conf), state(BR_CLOSED), open_until(0),
+        probe_until(0), probing(false), inflight(0)
+    {
+        memset(buckets, 0, sizeof(buckets));
+    }
+    mutex lock;
+    const breaker_conf_t conf;
+    br_state_t state;
+    apr_time_t open_until;
+    apr_time_t probe_until; // A probe which didn't report by then is replaced
+    bool probing;
+    apr_size_t inflight;
+    br_bucket_t buckets[BR_BUCKETS];
+};
+
+// The sources are spread over a few maps, each with its own lock
+#define BR_SHARDS 16
+
+struct br_shard_t {
+    mutex lock;
+    unordered_map<string, unique_ptr<source_health_t>> sources;
+};
+
+static atomic<bool> br_enabled(false);
+// Only used when a source is added, the sources keep a copy
+static mutex br_lock;
+static breaker_conf_t br_conf;
+static br_shard_t br_shards[BR_SHARDS];
+
+// Remote host for http:// URLs, otherwise the virtual host and the first path component,
+// usually a proxy location
+static string source_name(request_rec* r, const char* url) {
+    if (is_http_url(url)) {
+        const char* host = url + 7;
+        return string(url, host + strcspn(host, "/?#") - url);
+    }
+    string name(r->server->server_hostname ? r->server->server_hostname : "");
+    const char* end = ('/' == *url) ? url + 1 + strcspn(url + 1, "/?") : url;
+    return name.append(url, end - url);
+}
+
+static source_health_t* get_health(const string& name) {
+    br_shard_t& shard = br_shards[hash<string>()(name) % BR_SHARDS];
+    lock_guard<mutex> guard(shard.lock);
+    auto& h = shard.sources[name];
+    if (!h) {
+        lock_guard<mutex> conf_guard(br_lock);
+        h.reset(new source_health_t(br_conf));
+    }
+    return h.get();
+}
+
+int source_failed(int status) {
+    // Client errors are valid responses, except for timeouts and throttling
+    // APR error codes and errno values are failures
+    return !(APR_SUCCESS == status || (status >= 200 && status < 500
+        && status != 408 && status != 429));
+}
+
+void set_circuit_breaker(const breaker_conf_t& conf) {
+    br_enabled = false;
+    {
+        lock_guard<mutex> guard(br_lock);
+        br_conf = conf;
+    }
+    for (auto& shard : br_shards) {
+        lock_guard<mutex> guard(shard.lock);
+        shard.sources.clear();
+    }
+    br_enabled = 0 != conf.enabled;
+}
+
+int breaker_check(request_rec* r, const char* url, int* probe) {
+    if (probe)
+        *probe = 0;
+    if (!br_enabled)
+        return 0;
+    source_health_t* h = get_health(source_name(r, url));
+    const breaker_conf_t& conf = h->conf;
+
+    lock_guard<mutex> guard(h->lock);
+    if (conf.max_inflight && h->inflight >= conf.max_inflight)
+        return conf.status;
+    apr_time_t now = apr_time_now();
+    if (BR_OPEN == h->state) {
+        if (now < h->open_until)
+            return conf.status;
+        h->state = BR_HALF_OPEN;
+    }
+    if (BR_HALF_OPEN == h->state) {
+        // Only one probe at a time, from a caller which reports it
+        if (!probe || (h->probing && now < h->probe_until))
+            return conf.status;
+        h->probing = true;
+        h->probe_until = now + conf.open_time;
+        *probe = 1;
+    }
+    h->inflight++;
+    return 0;
+}
+
+void breaker_record(request_rec* r, const char* url, int status, apr_time_t latency, int probe) {
+    if (!br_enabled)
+        return;
+    source_health_t* h = get_health(source_name(r, url));
+    const breaker_conf_t& conf = h->conf;
+
+    bool failed = 0 != source_failed(status);
+    bool slow = conf.slow && latency > conf.slow;
+    apr_time_t now = apr_time_now();
+    apr_time_t sec = apr_time_sec(now);
+
+    lock_guard<mutex> guard(h->lock);
+    if (h->inflight)
+        h->inflight--;
+    // Only the probe decides, requests issued before the breaker opened don't
+    if (probe) {
+        if (BR_HALF_OPEN != h->state)
+            return;
+        h->probing = false;
+        if (failed || slow) {
+            h->state = BR_OPEN;
+            h->open_until = now + conf.open_time;
+        }
+        else {
+            // Start over with a clean window
+            h->state = BR_CLOSED;
+            memset(h->buckets, 0, sizeof(h->buckets));
+        }
+        return;
+    }
+    if (BR_CLOSED != h->state)
+        return;
+
+    br_bucket_t& b = h->buckets[sec % BR_BUCKETS];
+    if (b.sec != sec) {
+        memset(&b, 0, sizeof(b));
+        b.sec = sec;
+    }
+    b.total++;
+    b.errors += failed;
+    b.slow += slow;
+    if (!(failed || slow))
+        return;
+
+    apr_uint32_t total = 0, errors = 0, nslow = 0;
+    for (auto& bucket : h->buckets)
+        if (sec - bucket.sec < BR_BUCKETS) {
+            total += bucket.total;
+            errors += bucket.errors;
+            nslow += bucket.slow;
+        }
+    if (total >= conf.min_requests
+        && (errors >= conf.error_rate * total || nslow >= conf.error_rate * total))
+    {
+        h->state = BR_OPEN;
+        h->open_until = now + conf.open_time;
+    }
+}
+
+NS_AHTSE_END
@@ -0,0 +1,232 @@
+/*
+* ahtse_buffers.cpp
+*
+* Reusable tile buffers
+*
+* Large buffers are cached per thread, in power of two size classes, so steady state
+* tile serving doesn't allocate large blocks from the request pools.
+* The total idle size across all threads is capped
+*
+* (C) Lucian Plesea 2019-2021
+*
+*/
+
+#include "ahtse.h"
+#include <cstdlib>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+
+using namespace std;
+NS_ICD_USE
+
+NS_AHTSE_START
+
+// Smallest size class is 64KB, largest is 512MB, the MaxTileSize limit
+#define TB_MIN_BITS 16
+#define TB_MAX_BITS 29
+#define TB_CLASSES (TB_MAX_BITS - TB_MIN_BITS + 1)
+
+// Maximum number of idle buffers per size class per thread
+#define TB_PER_THREAD 4
+
+// Default global cap for idle buffers
+#define TB_DEFAULT_CAP (256 * 1024 * 1024)
+
+// Buffer header, keeps the buffer alignment
+// Buffers larger than the max size class are not cached, their class is TB_CLASSES
+#define TB_HEADER 64
+
+static atomic<size_t> idle_bytes(0);
+static atomic<size_t> idle_cap(TB_DEFAULT_CAP);
+
+static int size_class(apr_size_t size) {
+    int cls = 0;
+    while (cls < TB_CLASSES && (static_cast<apr_size_t>(1) << (cls + TB_MIN_BITS)) < size)
+        cls++;
+    return cls;
+}
+
+static apr_size_t class_size(int cls) {
+    return static_cast<apr_size_t>(1) << (cls + TB_MIN_BITS);
+}
+
+// Per thread idle lists, freed when the thread exits
+struct thread_buffers {
+    vector<void *> idle[TB_CLASSES];
+
+    ~thread_buffers() {
+        for (int cls = 0; cls < TB_CLASSES; cls++) {
+            for (auto block : idle[cls]) {
+                free(block);
+                idle_bytes -= class_size(cls);
+            }
+        }
+    }
+};
+
+static thread_local thread_buffers tbuffers;
+
+static int &buffer_class(void *buffer) {
+    return *reinterpret_cast<int *>(static_cast<char *>(buffer) - TB_HEADER);
+}
+
+// Returns the buffer to the current thread idle list, or frees it
+static void put_buffer(void *buffer) {
+    int cls = buffer_class(buffer);
+    void *block = static_cast<char *>(buffer) - TB_HEADER;
+    if (cls < TB_CLASSES && tbuffers.idle[cls].size() < TB_PER_THREAD) {
+        // Reserve first, other threads release buffers at the same time
+        size_t size = class_size(cls);
+        if (idle_bytes.fetch_add(size) + size <= idle_cap) {
+            tbuffers.idle[cls].push_back(block);
+            return;
+        }
+        idle_bytes -= size;
+    }
+    free(block);
+}
+
+static apr_status_t tile_buffer_cleanup(void *buffer) {
+    put_buffer(buffer);
+    return APR_SUCCESS;
+}
+
+void *get_tile_buffer(apr_pool_t *p, apr_size_t size) {
+    int cls = size_class(size);
+    void *block = nullptr;
+    if (cls < TB_CLASSES && !tbuffers.idle[cls].empty()) {
+        block = tbuffers.idle[cls].back();
+        tbuffers.idle[cls].pop_back();
+        idle_bytes -= class_size(cls);
+    }
+    else {
+        // Not cached, round up to the class size so it can be reused
+        block = malloc(TB_HEADER + (cls < TB_CLASSES ? class_size(cls) : size));
+        if (!block)
+            return nullptr;
+        *reinterpret_cast<int *>(block) = cls;
+    }
+
+    void *buffer = static_cast<char *>(block) + TB_HEADER;
+    apr_pool_cleanup_register(p, buffer, tile_buffer_cleanup, apr_pool_cleanup_null);
+    return buffer;
+}
+
+void release_tile_buffer(apr_pool_t *p, void *buffer) {
+    if (!buffer)
+        return;
+    apr_pool_cleanup_kill(p, buffer, tile_buffer_cleanup);
+    put_buffer(buffer);
+}
+
+void set_tile_buffer_cap(apr_size_t bytes) {
+    idle_cap = bytes;
+}
+
+//
+// Receive chain
+//
+
+receive_chain::receive_chain(const storage_manager& buffer) :
+    pool(nullptr), hint(buffer.size), maxsize(buffer.size), size(0), overflow(0),
+    room(buffer.size), last(buffer.size), first(buffer.size)
+{
+    segments.push_back(storage_manager(buffer.buffer, 0));
+}
+
+char* receive_chain::reserve(apr_size_t& len) {
+    if (0 == room) {
+        apr_size_t left = maxsize - size;
+        if (!pool || 0 == left) {
+            len = 0;
+            return nullptr;
+        }
+        apr_size_t ssize = segments.empty() ? hint : 2 * last;
+        ssize = std::min(std::max(ssize, static_cast<apr_size_t>(1)), left);
+        void* buffer = apr_palloc(pool, ssize);
+        if (!buffer) {
+            len = 0;
+            return nullptr;
+        }
+        if (segments.empty())
+            first = ssize;
+        segments.push_back(storage_manager(buffer, 0));
+        room = last = ssize;
+    }
+    // A sink reuses the segment, the room doesn't shrink
+    len = std::min(room, maxsize - size);
+    if (0 == len)
+        return nullptr;
+    return static_cast<char*>(segments.back().buffer) + segments.back().size;
+}
+
+bool receive_chain::append(const void* data, apr_size_t len) {
+    const char* src = static_cast<const char*>(data);
+    while (len) {
+        apr_size_t avail;
+        char* dst = reserve(avail);
+        if (!dst) {
+            overflow = true;
+            return false;
+        }
+        avail = std::min(avail, len);
+        memcpy(dst, src, avail);
+        commit(avail);
+        src += avail;
+        len -= avail;
+    }
+    return true;
+}
+
+storage_manager receive_chain::contiguous() {
+    if (segments.empty())
+        return storage_manager(nullptr, 0);
+    if (segments.size() == 1)
+        return segments[0];
+
+    // The new single segment is full
+    char* buffer = static_cast<char*>(apr_palloc(pool, size));
+    if (!buffer)
+        return storage_manager(nullptr, 0);
+    apr_size_t offset = 0;
+    for (auto& seg : segments) {
+        memcpy(buffer + offset, seg.buffer, seg.size);
+        offset += seg.size;
+    }
+    segments.clear();
+    segments.push_back(storage_manager(buffer, size));
+    room = 0;
+    last = first = size;
+    return segments[0];
+}
+
+apr_size_t receive_chain::peek(apr_size_t offset, void* dst, apr_size_t len) const {
+    char* out = static_cast<char*>(dst);
+    apr_size_t copied = 0;
+    for (auto& seg : segments) {
+        if (copied == len)
+            break;
+        if (offset >= seg.size) {
+            offset -= seg.size;
+            continue;
+        }
+        apr_size_t n = std::min(seg.size - offset, len - copied);
+        memcpy(out + copied, static_cast<const char*>(seg.buffer) + offset, n);
+        copied += n;
+        offset = 0;
+    }
+    return copied;
+}
+
+void receive_chain::reset() {
+    size = 0;
+    overflow = 0;
+    if (segments.empty())
+        return;
+    segments.resize(1);
+    segments[0].size = 0;
+    room = last = first;
+}
+
+NS_AHTSE_END
@@ -0,0 +1,229 @@
+/*
+* ahtse_cache.cpp
+*
+* Process wide page cache
+*
+* The cache is split in shards, each one with its own lock and LRU list, so concurrent
+* readers rarely wait. Pages are shared pointers, the lock is only held for the lookup
+*
+* Also the ETag index, the last ETag seen for each tile path, with one LRU list per layer
+*
+* (C) Lucian Plesea 2019-2021
+*
+*/
+
+#include "ahtse.h"
+#include <mutex>
+#include <list>
+#include <unordered_map>
+#include <functional>
+#include <atomic>
+#include <memory>
+
+using namespace std;
+NS_ICD_USE
+
+NS_AHTSE_START
+
+#define PC_SHARDS 16
+#define PC_DEFAULT_BUDGET (128 * 1024 * 1024)
+
+struct page_shard {
+    page_shard() : size(0) {}
+    mutex lock;
+    // Most recently used in front
+    list<pair<string, page_t>> lru;
+    unordered_map<string, decltype(lru)::iterator> pages;
+    size_t size;
+
+    // Drop pages from the back until size is within budget
+    void trim(size_t budget) {
+        while (size > budget && !lru.empty()) {
+            size -= lru.back().second->size();
+            pages.erase(lru.back().first);
+            lru.pop_back();
+        }
+    }
+};
+
+static page_shard shards[PC_SHARDS];
+static atomic<size_t> shard_budget(PC_DEFAULT_BUDGET / PC_SHARDS);
+
+static page_shard& get_shard(const string& key) {
+    return shards[hash<string>()(key) % PC_SHARDS];
+}
+
+page_t page_cache_get(const string& key) {
+    page_shard& shard = get_shard(key);
+    lock_guard<mutex> guard(shard.lock);
+    auto it = shard.pages.find(key);
+    if (it == shard.pages.end())
+        return page_t();
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    return it->second->second;
+}
+
+void page_cache_put(const string& key, const page_t& page) {
+    if (!page || page->size() > shard_budget)
+        return;
+    page_shard& shard = get_shard(key);
+    lock_guard<mutex> guard(shard.lock);
+    auto it = shard.pages.find(key);
+    if (it != shard.pages.end()) {
+        shard.size -= it->second->second->size();
+        shard.lru.erase(it->second);
+    }
+    shard.lru.emplace_front(key, page);
+    shard.pages[key] = shard.lru.begin();
+    shard.size += page->size();
+    shard.trim(shard_budget);
+}
+
+void set_page_cache_budget(size_t bytes) {
+    shard_budget = bytes / PC_SHARDS;
+    for (auto& shard : shards) {
+        lock_guard<mutex> guard(shard.lock);
+        shard.trim(shard_budget);
+    }
+}
+
+// Entries per layer, oldest are dropped
+#define EI_DEFAULT_SIZE (64 * 1024)
+// Seconds an ETag is used without being seen again
+#define EI_DEFAULT_TTL 60
+
+struct etag_entry_t {
+    string ETag;
+    apr_time_t seen;
+};
+
+struct etag_layer_t {
+    mutex lock;
+    // Most recently seen in front
+    list<pair<string, etag_entry_t>> lru;
+    unordered_map<string, decltype(lru)::iterator> paths;
+};
+
+static mutex ei_lock;
+static unordered_map<string, unique_ptr<etag_layer_t>> ei_layers;
+static atomic<size_t> ei_size(EI_DEFAULT_SIZE);
+static atomic<apr_time_t> ei_ttl(apr_time_from_sec(EI_DEFAULT_TTL));
+
+// Local paths depend on the virtual host. Tile paths are split at /tile, the layer
+// is the part before it, otherwise the folder
+static etag_layer_t* ei_layer(request_rec* r, const char* path, string& key) {
+    key.assign(r->server->server_hostname ? r->server->server_hostname : "");
+    key.append(" ").append(path);
+    const char* split = strstr(path, "/tile/");
+    if (!split)
+        split = strrchr(path, '/');
+    string layer(key, 0, key.size() - strlen(split ? split : ""));
+
+    lock_guard<mutex> guard(ei_lock);
+    auto& l = ei_layers[layer];
+    if (!l)
+        l.reset(new etag_layer_t);
+    return l.get();
+}
+
+void set_etag_index(size_t entries, apr_time_t ttl) {
+    lock_guard<mutex> guard(ei_lock);
+    ei_size = entries;
+    ei_ttl = ttl;
+    ei_layers.clear();
+}
+
+void etag_index_put(request_rec* r, const char* path, const char* ETag) {
+    if (0 == ei_size)
+        return;
+    string key;
+    etag_layer_t* layer = ei_layer(r, path, key);
+    lock_guard<mutex> guard(layer->lock);
+    auto it = layer->paths.find(key);
+    if (it != layer->paths.end()) {
+        layer->lru.erase(it->second);
+        layer->paths.erase(it);
+    }
+    if (!ETag)
+        return;
+    etag_entry_t entry;
+    entry.ETag = ETag;
+    entry.seen = apr_time_now();
+    layer->lru.emplace_front(key, entry);
+    layer->paths[key] = layer->lru.begin();
+    while (layer->lru.size() > ei_size) {
+        layer->paths.erase(layer->lru.back().first);
+        layer->lru.pop_back();
+    }
+}
+
+const char* etag_index_get(request_rec* r, const char* path) {
+    if (0 == ei_size)
+        return nullptr;
+    string key;
+    etag_layer_t* layer = ei_layer(r, path, key);
+    lock_guard<mutex> guard(layer->lock);
+    auto it = layer->paths.find(key);
+    // Expired entries are left in place, the next fetch refreshes them
+    if (it == layer->paths.end() || apr_time_now() - it->second->second.seen > ei_ttl)
+        return nullptr;
+    return apr_pstrdup(r->pool, it->second->second.ETag.c_str());
+}
+
+int etag_index_check(request_rec* r, const char* path) {
+    if (!apr_table_get(r->headers_in, "If-None-Match"))
+        return DECLINED;
+    const char* ETag = etag_index_get(r, path);
+    if (!ETag || !etagMatches(r, ETag))
+        return DECLINED;
+    apr_table_setn(r->headers_out, "ETag", ETag);
+    return HTTP_NOT_MODIFIED;
+}
+
+int get_decoded_tile(request_rec* r, const char* source, const sloc_t& tile,
+    const char* suffix, const TiledRaster& raster, page_t& page, char** psETag,
+    const char** msg)
+{
+    void* buffer = get_tile_buffer(r->pool, raster.maxtilesize);
+    if (!buffer)
+        return HTTP_INTERNAL_SERVER_ERROR;
+    storage_manager src(buffer, raster.maxtilesize);
+    char* ETag = nullptr;
+    int status = get_remote_tile(r, source, tile, src, &ETag, suffix);
+    if (psETag)
+        *psETag = ETag;
+    if (APR_SUCCESS != status) {
+        release_tile_buffer(r->pool, buffer);
+        return status;
+    }
+
+    // Without an ETag the content can't be validated, so it is not cached
+    string key;
+    if (ETag) {
+        key = pMLRC(r->pool, source, tile, suffix);
+        key.append(" ").append(ETag);
+        page = page_cache_get(key);
+        if (page) {
+            release_tile_buffer(r->pool, buffer);
+            return APR_SUCCESS;
+        }
+    }
+
+    auto decoded = make_shared<vector<uint8_t>>(raster.pagebytes());
+    codec_params params(raster.pageraster());
+    const char* error_message = stride_decode(params, src, decoded->data());
+    release_tile_buffer(r->pool, buffer);
+    if (error_message) {
+        // The message can be in params
+        if (msg)
+            *msg = apr_pstrdup(r->pool, error_message);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    page = decoded;
+    if (ETag)
+        page_cache_put(key, page);
+    return APR_SUCCESS;
+}
+
+NS_AHTSE_END
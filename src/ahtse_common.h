@@ -12,8 +12,12 @@
 #define AHTSE_COMMON_H
 
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
 #include <string>
+#include <vector>
+#include <memory>
+#include <functional>
 #include <icd_codecs.h>
 
 #define NS_AHTSE_START namespace AHTSE {
@@ -71,10 +75,28 @@
 #if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
 #define IS_BIGENDIAN
 #else
+#define NEED_SWAP
 #endif
 
 NS_AHTSE_START
 
+// Network order, big endian, to host order and back
+static inline uint64_t ntoh64(uint64_t v) {
+#if defined(NEED_SWAP)
+#if defined(_MSC_VER)
+    return _byteswap_uint64(v);
+#else
+    return __builtin_bswap64(v);
+#endif
+#else
+    return v;
+#endif
+}
+
+static inline uint64_t hton64(uint64_t v) {
+    return ntoh64(v);
+}
+
 // The maximum size of a tile
 #define MAX_TILE_SIZE 4*1024*1024
 
@@ -105,6 +127,13 @@ struct rset {
 // Bounding box
 struct bbox_t { double xmin, ymin, xmax, ymax; };
 
+// Kernels for 2x2 reduction
+enum reduce_t {
+    REDUCE_AVG = 0,     // Average of all values
+    REDUCE_NEAREST,     // Top left value
+    REDUCE_AVG_NDV      // Average of values which are not NoData
+};
+
 // Tile and pyramid raster, with some metadata
 // Does not contain C++ objects
 struct TiledRaster : public ICD::Raster {
@@ -129,6 +158,12 @@ struct TiledRaster : public ICD::Raster {
     size_t pagebytes() const {
         return getTypeSize(dt) * pagesize.x * pagesize.y * pagesize.c;
     }
+    // The raster of a single page, for the codecs
+    ICD::Raster pageraster() const {
+        ICD::Raster raster(*this);
+        raster.size = pagesize;
+        return raster;
+    }
 };
 
 // From a string in base32 returns a 64 + 1 bit integer
@@ -142,6 +177,40 @@ DLL_PUBLIC void tobase32(uint64_t value, char* buffer, int b65 = 0);
 // Reads a bounding box, x,y,X,Y order.  Expects up to four numbers in C locale, comma separated
 DLL_PUBLIC const char* getBBox(const char* line, bbox_t& bbox);
 
+//
+// Bounding box to tile planner, for front ends that mosaic source tiles
+//
+
+// Source tile and the pixel window it contributes
+struct tile_window_t {
+    // External tile address, the level excludes the skipped levels
+    sloc_t tile;
+    // Window inside the tile, in pixels
+    size_t x, y, w, h;
+    // Position of the window in the plan mosaic, in pixels
+    size_t ox, oy;
+};
+
+struct tile_plan_t {
+    // External level
+    size_t level;
+    // Covering tile rectangle, end exclusive
+    size_t tx0, ty0, tx1, ty1;
+    // Size of the mosaic, in pixels at the level resolution
+    size_t width, height;
+    // The area covered by the mosaic, aligned to level pixels
+    bbox_t bbox;
+    // Row major, one per tile
+    std::vector<tile_window_t> tiles;
+};
+
+// Picks the coarsest level at least as fine as the requested output size over bbox
+// and lists the tiles intersecting the bbox. Levels in SkippedLevels are not used
+// An empty tiles list means that the bbox is outside of the raster
+// Returns null on success, error message otherwise
+DLL_PUBLIC const char* plan_bbox(const TiledRaster& raster, const bbox_t& bbox,
+    size_t width, size_t height, tile_plan_t& plan);
+
 // Skip the leading white spaces and return true for "On" or "1"
 // otherwise it returns false
 DLL_PUBLIC int getBool(const char* s);
@@ -150,5 +219,93 @@ DLL_PUBLIC int getBool(const char* s);
 // "x y", "x y z" or "x y z c"
 DLL_PUBLIC const char* get_xyzc_size(ICD::sz5* size, const char* value);
 
+//
+// Process wide cache of pages, usually decoded tiles, with a size budget
+// Cached pages are immutable and shared, they stay valid while referenced
+//
+typedef std::shared_ptr<const std::vector<uint8_t>> page_t;
+
+// Returns the cached page or an empty pointer
+DLL_PUBLIC page_t page_cache_get(const std::string& key);
+
+// Adds or replaces a page, least recently used pages are dropped to keep within budget
+DLL_PUBLIC void page_cache_put(const std::string& key, const page_t& page);
+
+// Sets the page cache budget in bytes, defaults to 128MB. Zero disables the cache
+DLL_PUBLIC void set_page_cache_budget(size_t bytes);
+
+//
+// Pixel kernels, on pages of a TiledRaster, specialized for each data type
+// Use SSE4.1 or AVX2 when the CPU supports them
+//
+
+// Converts count values, integer destinations are rounded and saturated
+DLL_PUBLIC void convert_values(const void* src, ICD::ICDDataType sdt, void* dst,
+    ICD::ICDDataType ddt, size_t count);
+
+// Sets the mask to 0 for NoData values and 255 otherwise, one byte per value
+// Returns the number of NoData values
+DLL_PUBLIC size_t ndv_mask(const TiledRaster& raster, const void* page, uint8_t* mask);
+
+// Scales a page to Byte, MinValue to 0 and MaxValue to 255, NoData becomes 0
+// Without min and max, the data type range is used, or 0 to 1 for floating point
+DLL_PUBLIC void scale_to_byte(const TiledRaster& raster, const void* page, uint8_t* dst);
+
+// Reduces a page by 2 in both directions, into a w by h window of dst, using one of the reduce_t kernels
+// The dst stride is in values
+DLL_PUBLIC void reduce_2x2(const TiledRaster& raster, const void* src, void* dst,
+    size_t dstride, size_t w, size_t h, int kernel);
+
+// Limits the SIMD code used by the kernels, 0 is scalar, 1 is SSE4.1, 2 is AVX2, the default
+// For testing and benchmarks
+DLL_PUBLIC void set_simd_limit(int level);
+
+// Sets count values to value, converted to the data type
+DLL_PUBLIC void fill_values(void* dst, ICD::ICDDataType dt, size_t count, double value);
+
+// True if every value is NoData, or zero when there is no NoData
+// Also true for two or four band rasters with the last band zero, fully transparent
+// Floating point values are compared bit for bit, except for NaN NoData
+DLL_PUBLIC int is_empty_page(const TiledRaster& raster, const void* page);
+
+//
+// Shared pool of worker threads, for CPU bound work
+//
+
+// Sets the number of worker threads, defaults to the number of cores
+// Threads are started when needed, the number doesn't go down
+DLL_PUBLIC void set_worker_threads(size_t n);
+
+// Queues a job for the worker threads, returns right away
+// The job can block, a thread is added when none is idle, up to a limit
+DLL_PUBLIC void worker_submit(std::function<void()> job);
+
+// Calls f(i) for i from 0 to n - 1, in parallel on the worker threads and the calling thread
+// Returns when all calls are done
+DLL_PUBLIC void parallel_for(size_t n, const std::function<void(size_t)>& f);
+
+// Decodes tiles in parallel and copies each one to its window in dst, which has
+// width x height pixels. dst is filled with NoData, or zero, where there is no tile
+// srcs are the encoded tiles, in the same order as tiles. A null or empty one is missing
+// Returns null on success, otherwise the codec error message of the first tile that failed,
+// valid until the next call from the same thread
+DLL_PUBLIC const char* mosaic(const TiledRaster& raster, const std::vector<tile_window_t>& tiles,
+    const ICD::storage_manager* srcs, void* dst, size_t width, size_t height);
+
+//
+// Decompression of source content
+// gzip and zstd are detected from the signature, zlib and raw deflate have to be configured
+// zstd needs HAVE_ZSTD, without it zstd content is not detected, libdeflate is used for the deflate formats when HAVE_LIBDEFLATE is set
+//
+
+enum zip_t { ZIP_NONE = 0, ZIP_GZIP, ZIP_ZLIB, ZIP_DEFLATE, ZIP_ZSTD };
+
+// The compression of src, assumed is returned when no signature matches
+DLL_PUBLIC zip_t zip_type(const ICD::storage_manager& src, zip_t assumed = ZIP_NONE);
+
+// One shot decompression of src into dst, returns true on success and sets dst.size
+// When dst is too small, returns false and sets dst.size to -1
+DLL_PUBLIC bool unzip(zip_t type, const ICD::storage_manager& src, ICD::storage_manager& dst);
+
 NS_AHTSE_END
 #endif
\ No newline at end of file
@@ -0,0 +1,428 @@
+/*
+* ahtse_diskcache.cpp
+*
+* Persistent cache of remote range reads, on local disk
+*
+* The data is appended to a ring of fixed size slab files. When the current slab is full
+* the oldest one is reused, which drops all its records at once. A memory mapped index
+* file holds the hash table and the slab generations, so it is shared by all processes
+* and survives restarts
+* The index also holds the validators of the source files, one per URL, with the time
+* they were last confirmed by the source
+* Records are written before they are published in the index and are checked on read,
+* a crash or a reused slab only turns into cache misses
+*
+* (C) Lucian Plesea 2019-2021
+*
+*/
+
+#include "ahtse.h"
+#include <apr_mmap.h>
+#include <new>
+#include <mutex>
+#include <string>
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+using namespace std;
+NS_ICD_USE
+
+NS_AHTSE_START
+
+// Smallest slab size
+#define DC_SLAB_SIZE (64 * 1024 * 1024)
+#define DC_MAX_SLABS 256
+// Expected average record size, sets the number of index slots
+#define DC_RECORD_SIZE (16 * 1024)
+// Slots checked for a key
+#define DC_PROBES 8
+// Index header size, the slots follow
+#define DC_HEADER_SIZE 4096
+// Source validators, after the slots
+#define DC_VALIDATORS 16384
+#define DC_VALIDATOR_SIZE 100
+// Default seconds a validator is used before it is confirmed again
+#define DC_VALIDATOR_TTL 300
+#define DC_MAGIC "AHTSEDC2"
+#define DC_RECORD_MAGIC 0x41444352
+
+struct dc_header_t {
+    char magic[8];
+    uint64_t slab_size, nslabs, nslots, nvalidators;
+    // Current slab and write position in it
+    uint64_t cur, wpos;
+    // Last generation assigned to a slab
+    uint64_t gen_counter;
+    // Generation of each slab, records from older generations are gone
+    uint64_t gen[DC_MAX_SLABS];
+};
+
+struct dc_slot_t {
+    uint64_t hash; // Zero if empty
+    uint64_t gen;
+    uint64_t offset;
+    uint32_t slab;
+    uint32_t size; // Record size
+};
+
+struct dc_validator_t {
+    uint64_t hash; // Of the url, zero if empty
+    uint64_t check; // Of the url and the other fields, detects a partial update
+    int64_t checked; // Last time the source confirmed it
+    uint32_t len;
+    char value[DC_VALIDATOR_SIZE];
+};
+
+// Followed by the key, the tag and the data
+struct dc_record_t {
+    uint64_t hash, gen, checksum, total;
+    uint32_t magic, keylen, taglen, datalen;
+};
+
+struct disk_cache_t {
+    apr_file_t* index;
+    dc_header_t* header;
+    dc_slot_t* slots;
+    dc_validator_t* validators;
+    apr_file_t** slabs;
+    apr_interval_time_t validator_ttl;
+    // Writers hold it and the index file lock, which excludes other processes
+    mutex lock;
+};
+
+static disk_cache_t* dcache = nullptr;
+
+static uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ULL) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ p[i]) * 0x100000001b3ULL;
+    return hash;
+}
+
+static uint64_t dc_validator_check(const dc_validator_t& v, uint64_t urlhash) {
+    uint64_t hash = fnv1a(&v.checked, sizeof(v.checked), urlhash);
+    return fnv1a(v.value, v.len < DC_VALIDATOR_SIZE ? v.len : DC_VALIDATOR_SIZE, hash);
+}
+
+static string dc_key(const char* url, apr_off_t offset, apr_size_t size, const char* validator) {
+    string key(url);
+    key.append(" ").append(to_string(static_cast<unsigned long long>(offset)));
+    key.append(" ").append(to_string(static_cast<unsigned long long>(size)));
+    key.append(" ").append(validator ? validator : "");
+    return key;
+}
+
+// Positional read and write, return the number of bytes transferred
+static apr_size_t slab_io(apr_file_t* f, bool write, apr_off_t offset, void* buffer,
+    apr_size_t size)
+{
+#if defined(_WIN32)
+    // No positional IO in apr, serialize all access
+    static mutex io_lock;
+    lock_guard<mutex> guard(io_lock);
+    if (APR_SUCCESS != apr_file_seek(f, APR_SET, &offset))
+        return 0;
+    apr_size_t done = 0;
+    if (write)
+        apr_file_write_full(f, buffer, size, &done);
+    else
+        apr_file_read_full(f, buffer, size, &done);
+    return done;
+#else
+    apr_os_file_t fd;
+    apr_os_file_get(&fd, f);
+    apr_size_t done = 0;
+    char* b = static_cast<char*>(buffer);
+    while (done < size) {
+        auto got = write ? pwrite(fd, b + done, size - done, static_cast<off_t>(offset + done))
+            : pread(fd, b + done, size - done, static_cast<off_t>(offset + done));
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            break;
+        done += got;
+    }
+    return done;
+#endif
+}
+
+static apr_status_t disk_cache_cleanup(void* data) {
+    auto dc = static_cast<disk_cache_t*>(data);
+    if (dcache == dc)
+        dcache = nullptr;
+    dc->~disk_cache_t();
+    return APR_SUCCESS;
+}
+
+const char* set_disk_cache(apr_pool_t* p, const char* path, apr_uint64_t budget,
+    apr_interval_time_t validator_ttl)
+{
+    dcache = nullptr;
+    if (0 == budget)
+        return nullptr;
+
+    uint64_t slab_size = DC_SLAB_SIZE;
+    if (budget / DC_MAX_SLABS > slab_size)
+        slab_size = budget / DC_MAX_SLABS;
+    uint64_t nslabs = budget / slab_size;
+    if (nslabs < 2)
+        return "Disk cache budget too small";
+    uint64_t nslots = 1024;
+    while (nslots < budget / DC_RECORD_SIZE)
+        nslots *= 2;
+
+    apr_status_t stat = apr_dir_make_recursive(path, APR_OS_DEFAULT, p);
+    if (APR_SUCCESS != stat)
+        return apr_psprintf(p, "Can't create %s, %pm", path, &stat);
+
+    auto dc = new (apr_pcalloc(p, sizeof(disk_cache_t))) disk_cache_t;
+    apr_pool_cleanup_register(p, dc, disk_cache_cleanup, apr_pool_cleanup_null);
+    dc->validator_ttl = validator_ttl < 0 ? apr_time_from_sec(DC_VALIDATOR_TTL) : validator_ttl;
+
+    const char* fname = apr_pstrcat(p, path, "/index", NULL);
+    stat = apr_file_open(&dc->index, fname, APR_FOPEN_READ | APR_FOPEN_WRITE
+        | APR_FOPEN_CREATE | APR_FOPEN_BINARY | APR_FOPEN_LARGEFILE, APR_OS_DEFAULT, p);
+    if (APR_SUCCESS != stat)
+        return apr_psprintf(p, "Can't open %s, %pm", fname, &stat);
+
+    // Another process could be initializing the same index
+    apr_file_lock(dc->index, APR_FLOCK_EXCLUSIVE);
+    const char* message = nullptr;
+    apr_uint64_t isize = DC_HEADER_SIZE + nslots * sizeof(dc_slot_t)
+        + DC_VALIDATORS * sizeof(dc_validator_t);
+    dc_header_t h;
+    apr_size_t nread = 0;
+    apr_off_t off = 0;
+    apr_file_seek(dc->index, APR_SET, &off);
+    apr_file_read_full(dc->index, &h, sizeof(h), &nread);
+    // A different layout starts empty
+    bool reset = nread != sizeof(h) || memcmp(h.magic, DC_MAGIC, 8)
+        || h.slab_size != slab_size || h.nslabs != nslabs || h.nslots != nslots
+        || h.nvalidators != DC_VALIDATORS;
+    if (reset) {
+        stat = apr_file_trunc(dc->index, 0);
+        if (APR_SUCCESS == stat)
+            stat = apr_file_trunc(dc->index, isize);
+        if (APR_SUCCESS != stat)
+            message = apr_psprintf(p, "Can't size %s, %pm", fname, &stat);
+    }
+
+    apr_mmap_t* mm = nullptr;
+    if (!message) {
+        stat = apr_mmap_create(&mm, dc->index, 0, static_cast<apr_size_t>(isize),
+            APR_MMAP_READ | APR_MMAP_WRITE, p);
+        if (APR_SUCCESS != stat)
+            message = apr_psprintf(p, "Can't map %s, %pm", fname, &stat);
+    }
+
+    if (!message) {
+        dc->header = static_cast<dc_header_t*>(mm->mm);
+        dc->slots = reinterpret_cast<dc_slot_t*>(static_cast<char*>(mm->mm) + DC_HEADER_SIZE);
+        dc->validators = reinterpret_cast<dc_validator_t*>(dc->slots + nslots);
+        if (reset) {
+            memset(dc->header, 0, sizeof(dc_header_t));
+            dc->header->slab_size = slab_size;
+            dc->header->nslabs = nslabs;
+            dc->header->nslots = nslots;
+            dc->header->nvalidators = DC_VALIDATORS;
+            dc->header->gen_counter = dc->header->gen[0] = 1;
+            // Last, it makes the index valid
+            memcpy(dc->header->magic, DC_MAGIC, 8);
+        }
+    }
+    apr_file_unlock(dc->index);
+    if (message)
+        return message;
+
+    dc->slabs = static_cast<apr_file_t**>(apr_pcalloc(p, sizeof(apr_file_t*) * nslabs));
+    for (uint64_t i = 0; i < nslabs; i++) {
+        fname = apr_psprintf(p, "%s/slab%03d", path, static_cast<int>(i));
+        stat = apr_file_open(&dc->slabs[i], fname, APR_FOPEN_READ | APR_FOPEN_WRITE
+            | APR_FOPEN_CREATE | APR_FOPEN_BINARY | APR_FOPEN_LARGEFILE, APR_OS_DEFAULT, p);
+        if (APR_SUCCESS != stat)
+            return apr_psprintf(p, "Can't open %s, %pm", fname, &stat);
+    }
+
+    dcache = dc;
+    return nullptr;
+}
+
+apr_status_t disk_cache_get(const char* url, apr_off_t offset, const char* validator,
+    storage_manager& dst, string* tag, apr_uint64_t* total)
+{
+    disk_cache_t* dc = dcache;
+    if (!dc)
+        return APR_NOTFOUND;
+
+    const dc_header_t* h = dc->header;
+    string key = dc_key(url, offset, dst.size, validator);
+    uint64_t hash = fnv1a(key.c_str(), key.size()) | 1;
+    for (uint64_t i = 0; i < DC_PROBES; i++) {
+        dc_slot_t slot = dc->slots[(hash + i) & (h->nslots - 1)];
+        if (slot.hash != hash || slot.slab >= h->nslabs || slot.gen != h->gen[slot.slab])
+            continue;
+
+        // The record might have been overwritten since the slot was read
+        dc_record_t rec;
+        apr_file_t* f = dc->slabs[slot.slab];
+        if (sizeof(rec) != slab_io(f, false, slot.offset, &rec, sizeof(rec))
+            || DC_RECORD_MAGIC != rec.magic || rec.hash != hash || rec.gen != slot.gen
+            || rec.keylen != key.size() || rec.datalen != dst.size)
+            continue;
+
+        string kt(rec.keylen + rec.taglen, '\0');
+        apr_off_t pos = slot.offset + sizeof(rec);
+        if (kt.size() != slab_io(f, false, pos, &kt[0], kt.size())
+            || kt.compare(0, rec.keylen, key))
+            continue;
+
+        pos += kt.size();
+        if (dst.size != slab_io(f, false, pos, dst.buffer, dst.size)
+            || rec.checksum != fnv1a(dst.buffer, dst.size)
+            || slot.gen != h->gen[slot.slab])
+            continue;
+
+        if (tag)
+            tag->assign(kt, rec.keylen, string::npos);
+        if (total)
+            *total = rec.total;
+        return APR_SUCCESS;
+    }
+    return APR_NOTFOUND;
+}
+
+void disk_cache_put(const char* url, apr_off_t offset, const char* validator,
+    const storage_manager& src, const char* tag, apr_uint64_t total)
+{
+    disk_cache_t* dc = dcache;
+    if (!dc)
+        return;
+
+    dc_header_t* h = dc->header;
+    string key = dc_key(url, offset, src.size, validator);
+    dc_record_t rec;
+    rec.magic = DC_RECORD_MAGIC;
+    rec.hash = fnv1a(key.c_str(), key.size()) | 1;
+    rec.checksum = fnv1a(src.buffer, src.size);
+    rec.total = total;
+    rec.keylen = static_cast<uint32_t>(key.size());
+    rec.taglen = tag ? static_cast<uint32_t>(strlen(tag)) : 0;
+    rec.datalen = static_cast<uint32_t>(src.size);
+    uint64_t rsize = sizeof(rec) + rec.keylen + rec.taglen + rec.datalen;
+    // Large records would waste most of a slab
+    if (rsize > h->slab_size / 4)
+        return;
+
+    // The record goes in a single write
+    vector<char> buffer(static_cast<size_t>(rsize));
+    char* p = buffer.data() + sizeof(rec);
+    memcpy(p, key.c_str(), rec.keylen);
+    p += rec.keylen;
+    if (tag)
+        memcpy(p, tag, rec.taglen);
+    memcpy(p + rec.taglen, src.buffer, src.size);
+
+    lock_guard<mutex> guard(dc->lock);
+    if (APR_SUCCESS != apr_file_lock(dc->index, APR_FLOCK_EXCLUSIVE))
+        return;
+
+    // Move to the next slab, dropping its records
+    if (h->wpos + rsize > h->slab_size) {
+        h->cur = (h->cur + 1) % h->nslabs;
+        h->gen[h->cur] = ++h->gen_counter;
+        h->wpos = 0;
+    }
+    rec.gen = h->gen[h->cur];
+    memcpy(buffer.data(), &rec, sizeof(rec));
+
+    if (rsize == slab_io(dc->slabs[h->cur], true, h->wpos, buffer.data(), rsize)) {
+        // Reuse the slot of the same key, or an empty or stale one, otherwise the oldest
+        dc_slot_t* target = nullptr;
+        for (uint64_t i = 0; i < DC_PROBES; i++) {
+            dc_slot_t* slot = &dc->slots[(rec.hash + i) & (h->nslots - 1)];
+            bool stale = 0 == slot->hash || slot->slab >= h->nslabs
+                || slot->gen != h->gen[slot->slab];
+            if (slot->hash == rec.hash || stale) {
+                target = slot;
+                break;
+            }
+            if (!target || slot->gen < target->gen)
+                target = slot;
+        }
+        // Readers verify the record, a partial update is only a miss
+        target->hash = 0;
+        target->gen = rec.gen;
+        target->offset = h->wpos;
+        target->slab = static_cast<uint32_t>(h->cur);
+        target->size = static_cast<uint32_t>(rsize);
+        target->hash = rec.hash;
+        h->wpos += rsize;
+    }
+
+    apr_file_unlock(dc->index);
+}
+
+apr_status_t disk_cache_get_validator(const char* url, string& validator, bool* stale) {
+    disk_cache_t* dc = dcache;
+    if (!dc)
+        return APR_NOTFOUND;
+
+    uint64_t hash = fnv1a(url, strlen(url)) | 1;
+    for (uint64_t i = 0; i < DC_PROBES; i++) {
+        // A copy, another process might be updating it
+        dc_validator_t v = dc->validators[(hash + i) % DC_VALIDATORS];
+        if (v.hash != hash || v.len > DC_VALIDATOR_SIZE || v.check != dc_validator_check(v, hash))
+            continue;
+        validator.assign(v.value, v.len);
+        if (stale)
+            *stale = apr_time_now() - v.checked > dc->validator_ttl;
+        return APR_SUCCESS;
+    }
+    return APR_NOTFOUND;
+}
+
+void disk_cache_put_validator(const char* url, const char* validator) {
+    disk_cache_t* dc = dcache;
+    size_t len = validator ? strlen(validator) : 0;
+    // Content without a validator is not cached
+    if (!dc || 0 == len || len > DC_VALIDATOR_SIZE)
+        return;
+
+    dc_validator_t v;
+    memset(&v, 0, sizeof(v));
+    v.hash = fnv1a(url, strlen(url)) | 1;
+    v.checked = apr_time_now();
+    v.len = static_cast<uint32_t>(len);
+    memcpy(v.value, validator, len);
+    v.check = dc_validator_check(v, v.hash);
+
+    lock_guard<mutex> guard(dc->lock);
+    if (APR_SUCCESS != apr_file_lock(dc->index, APR_FLOCK_EXCLUSIVE))
+        return;
+
+    // Reuse the entry of the same url or an empty one, otherwise the least recently checked
+    dc_validator_t* target = nullptr;
+    for (uint64_t i = 0; i < DC_PROBES; i++) {
+        dc_validator_t* entry = &dc->validators[(v.hash + i) % DC_VALIDATORS];
+        if (entry->hash == v.hash || 0 == entry->hash) {
+            target = entry;
+            break;
+        }
+        if (!target || entry->checked < target->checked)
+            target = entry;
+    }
+    // Readers verify the check, a partial update is only a miss
+    target->hash = 0;
+    memcpy(target->value, v.value, sizeof(v.value));
+    target->len = v.len;
+    target->checked = v.checked;
+    target->check = v.check;
+    target->hash = v.hash;
+
+    apr_file_unlock(dc->index);
+}
+
+NS_AHTSE_END
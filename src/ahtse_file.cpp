@@ -0,0 +1,562 @@
+/*
+* ahtse_file.cpp
+*
+* Direct reads from local files
+* Read only file handles are kept open in a process wide cache
+* Multiple reads are submitted together through io_uring on linux, when available
+*
+* (C) Lucian Plesea 2019-2021
+*
+*/
+
+#include "ahtse.h"
+#include <httpd.h>
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <atomic>
+#endif
+#endif
+
+using namespace std;
+NS_ICD_USE
+
+NS_AHTSE_START
+
+// Read exactly size bytes at offset from an open file
+// Returns the number of bytes read, which is less than size on error or end of file
+static apr_size_t file_pread(apr_file_t* f, apr_off_t offset, void* buffer, apr_size_t size) {
+#if defined(_WIN32)
+    // No positional reads in apr, the caller serializes access to the file
+    if (APR_SUCCESS != apr_file_seek(f, APR_SET, &offset))
+        return 0;
+    apr_size_t nread = 0;
+    apr_file_read_full(f, buffer, size, &nread);
+    return nread;
+#else
+    apr_os_file_t fd;
+    apr_os_file_get(&fd, f);
+    apr_size_t nread = 0;
+    while (nread < size) {
+        auto got = pread(fd, static_cast<char*>(buffer) + nread, size - nread,
+            static_cast<off_t>(offset + nread));
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            break;
+        nread += got;
+    }
+    return nread;
+#endif
+}
+
+// Default maximum number of cached open files
+#define FC_DEFAULT_MAX 256
+// Seconds between checks that a cached file is still the same one
+#define FC_CHECK_INTERVAL 5
+
+struct cached_file_t {
+    string path;
+    // Each file has its own pool, cached files outlive requests
+    apr_pool_t* pool;
+    apr_file_t* file;
+    apr_off_t size;
+    apr_ino_t inode;
+    apr_dev_t device;
+    apr_time_t mtime;
+    apr_time_t checked;
+    int refs;
+    // Not in the cache, closed on last release
+    bool stale;
+    list<cached_file_t*>::iterator lru;
+#if defined(_WIN32)
+    // Seek and read are not atomic
+    mutex lock;
+#endif
+};
+
+static mutex fc_lock;
+static unordered_map<string, cached_file_t*> fc_files;
+// Most recently used in front
+static list<cached_file_t*> fc_lru;
+static size_t fc_max = FC_DEFAULT_MAX;
+
+static void close_file(cached_file_t* cf) {
+    apr_pool_destroy(cf->pool);
+    delete cf;
+}
+
+// Removes an entry from the cache, it will be closed on last release
+// Call with the cache lock held
+static void fc_remove(cached_file_t* cf) {
+    if (cf->stale)
+        return;
+    fc_files.erase(cf->path);
+    fc_lru.erase(cf->lru);
+    cf->stale = true;
+}
+
+// Evict unused files until the cache is within limits, returns the files to close
+// Call with the cache lock held
+static list<cached_file_t*> fc_trim() {
+    list<cached_file_t*> victims;
+    // From the back, erase returns the entry after the removed one, which was already seen
+    auto it = fc_lru.end();
+    while (fc_files.size() > fc_max && it != fc_lru.begin()) {
+        cached_file_t* cf = *--it;
+        if (cf->refs)
+            continue;
+        fc_files.erase(cf->path);
+        it = fc_lru.erase(it);
+        cf->stale = true;
+        victims.push_back(cf);
+    }
+    return victims;
+}
+
+static bool same_file(const cached_file_t* cf, const apr_finfo_t& finfo) {
+    return cf->inode == finfo.inode && cf->device == finfo.device
+        && cf->mtime == finfo.mtime && cf->size == finfo.size;
+}
+
+static bool same_file(const cached_file_t* cf, const cached_file_t& other) {
+    return cf->inode == other.inode && cf->device == other.device
+        && cf->mtime == other.mtime && cf->size == other.size;
+}
+
+#define FC_FINFO (APR_FINFO_IDENT | APR_FINFO_MTIME | APR_FINFO_SIZE)
+
+static cached_file_t* open_file(const char* path, apr_status_t* pstat) {
+    apr_pool_t* pool;
+    apr_status_t stat = apr_pool_create(&pool, nullptr);
+    if (APR_SUCCESS != stat) {
+        *pstat = stat;
+        return nullptr;
+    }
+
+    apr_file_t* f;
+    apr_finfo_t finfo;
+    stat = apr_file_open(&f, path, RANDOM_READ_RIGHTS | APR_FOPEN_XTHREAD, 0, pool);
+    if (APR_SUCCESS == stat)
+        stat = apr_file_info_get(&finfo, FC_FINFO, f);
+    if (APR_SUCCESS != stat) {
+        apr_pool_destroy(pool);
+        *pstat = stat;
+        return nullptr;
+    }
+
+    auto cf = new cached_file_t;
+    cf->path = path;
+    cf->pool = pool;
+    cf->file = f;
+    cf->size = finfo.size;
+    cf->inode = finfo.inode;
+    cf->device = finfo.device;
+    cf->mtime = finfo.mtime;
+    cf->checked = apr_time_now();
+    cf->refs = 1;
+    cf->stale = true;
+    return cf;
+}
+
+cached_file_t* acquire_file(const char* path, apr_status_t* pstat) {
+    apr_status_t stat;
+    if (!pstat)
+        pstat = &stat;
+    *pstat = APR_SUCCESS;
+
+    cached_file_t* cf = nullptr;
+    bool check = false;
+    {
+        lock_guard<mutex> guard(fc_lock);
+        auto it = fc_files.find(path);
+        if (it != fc_files.end()) {
+            cf = it->second;
+            cf->refs++;
+            fc_lru.splice(fc_lru.begin(), fc_lru, cf->lru);
+            // Only one thread does the check
+            apr_time_t now = apr_time_now();
+            if (now - cf->checked > apr_time_from_sec(FC_CHECK_INTERVAL)) {
+                cf->checked = now;
+                check = true;
+            }
+        }
+    }
+
+    if (cf && check) {
+        // Replaced or modified since it was opened
+        apr_finfo_t finfo;
+        apr_pool_t* pool;
+        bool same = false;
+        if (APR_SUCCESS == apr_pool_create(&pool, nullptr)) {
+            same = APR_SUCCESS == apr_stat(&finfo, path, FC_FINFO, pool) && same_file(cf, finfo);
+            apr_pool_destroy(pool);
+        }
+        if (!same) {
+            {
+                lock_guard<mutex> guard(fc_lock);
+                fc_remove(cf);
+            }
+            release_file(cf);
+            cf = nullptr;
+        }
+    }
+
+    if (cf)
+        return cf;
+
+    // Not in cache, open it without holding the lock
+    cf = open_file(path, pstat);
+    if (!cf)
+        return nullptr;
+
+    cached_file_t* extra = nullptr;
+    list<cached_file_t*> victims;
+    {
+        lock_guard<mutex> guard(fc_lock);
+        auto it = fc_files.find(path);
+        if (it != fc_files.end() && same_file(it->second, *cf)) {
+            // Another thread opened it first, use that one
+            extra = cf;
+            cf = it->second;
+            cf->refs++;
+        }
+        else {
+            if (it != fc_files.end()) { // Changed, replace it
+                cached_file_t* old = it->second;
+                fc_remove(old);
+                if (0 == old->refs)
+                    victims.push_back(old);
+            }
+            cf->stale = false;
+            fc_lru.push_front(cf);
+            cf->lru = fc_lru.begin();
+            fc_files[cf->path] = cf;
+            victims.splice(victims.end(), fc_trim());
+        }
+    }
+
+    if (extra)
+        close_file(extra);
+    for (auto victim : victims)
+        close_file(victim);
+    return cf;
+}
+
+void release_file(cached_file_t* cf) {
+    bool last;
+    {
+        lock_guard<mutex> guard(fc_lock);
+        last = (0 == --cf->refs) && cf->stale;
+    }
+    if (last)
+        close_file(cf);
+}
+
+apr_size_t cached_pread(cached_file_t* cf, apr_off_t offset, void* buffer, apr_size_t size) {
+#if defined(_WIN32)
+    lock_guard<mutex> guard(cf->lock);
+#endif
+    return file_pread(cf->file, offset, buffer, size);
+}
+
+apr_off_t cached_file_size(const cached_file_t* cf) {
+    return cf->size;
+}
+
+void set_file_cache_limit(size_t max_open) {
+    list<cached_file_t*> victims;
+    {
+        lock_guard<mutex> guard(fc_lock);
+        fc_max = max_open;
+        victims = fc_trim();
+    }
+    for (auto victim : victims)
+        close_file(victim);
+}
+
+int vfile_pread(request_rec* r, const vfile_t& vf, apr_off_t offset, storage_manager& dst,
+    const char** msg)
+{
+    if (vf.range.size && (static_cast<apr_uint64_t>(offset) < vf.range.offset
+        || offset + dst.size > vf.range.offset + vf.range.size))
+    {
+        if (msg)
+            *msg = "Read outside of the file range";
+        return HTTP_RANGE_NOT_SATISFIABLE;
+    }
+
+    apr_status_t stat;
+    cached_file_t* cf = acquire_file(vf.name, &stat);
+    if (cf) {
+        apr_size_t nread = cached_pread(cf, offset, dst.buffer, dst.size);
+        release_file(cf);
+        if (nread != dst.size) {
+            if (msg)
+                *msg = apr_psprintf(r->pool, "Short read from %s", vf.name);
+            return HTTP_NOT_FOUND;
+        }
+        return APR_SUCCESS;
+    }
+
+    // Not a local file, read it as a redirect
+    if (!APR_STATUS_IS_ENOENT(stat)) {
+        if (msg)
+            *msg = apr_psprintf(r->pool, "Can't open %s, %pm", vf.name, &stat);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (0 == range_read(r, vf.name, offset, dst, 4, msg))
+        return HTTP_NOT_FOUND;
+    return APR_SUCCESS;
+}
+
+//
+// Batch reads
+//
+
+// Finish a read synchronously, from where it got to
+static void finish_read(read_req_t& req) {
+    if (req.nread < req.size)
+        req.nread += cached_pread(req.file, req.offset + req.nread,
+            static_cast<char*>(req.buffer) + req.nread, req.size - req.nread);
+}
+
+#if defined(HAVE_URING)
+
+// Ring size, larger batches are submitted in chunks
+#define URING_ENTRIES 64
+
+// Set if io_uring can't be used in this process
+static atomic<bool> uring_disabled(false);
+
+// A raw io_uring, one per thread
+struct uring_t {
+    uring_t() : fd(-1), sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED), sqes(nullptr) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd = static_cast<int>(syscall(__NR_io_uring_setup, URING_ENTRIES, &params));
+        if (fd < 0)
+            return;
+
+        sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_len = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        single = 0 != (params.features & IORING_FEAT_SINGLE_MMAP);
+        if (single)
+            sq_len = cq_len = max(sq_len, cq_len);
+
+        sq_ptr = mmap(nullptr, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            fd, IORING_OFF_SQ_RING);
+        if (MAP_FAILED == sq_ptr) {
+            close_ring();
+            return;
+        }
+        cq_ptr = single ? sq_ptr : mmap(nullptr, cq_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (MAP_FAILED == cq_ptr) {
+            close_ring();
+            return;
+        }
+        sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+        void* p = mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            fd, IORING_OFF_SQES);
+        if (MAP_FAILED == p) {
+            close_ring();
+            return;
+        }
+        sqes = static_cast<io_uring_sqe*>(p);
+
+        char* sq = static_cast<char*>(sq_ptr);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sq_entries = params.sq_entries;
+        char* cq = static_cast<char*>(cq_ptr);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    }
+
+    ~uring_t() {
+        close_ring();
+    }
+
+    void close_ring() {
+        if (sqes)
+            munmap(sqes, sqes_len);
+        if (MAP_FAILED != cq_ptr && cq_ptr != sq_ptr)
+            munmap(cq_ptr, cq_len);
+        if (MAP_FAILED != sq_ptr)
+            munmap(sq_ptr, sq_len);
+        if (fd >= 0)
+            ::close(fd);
+        sqes = nullptr;
+        sq_ptr = cq_ptr = MAP_FAILED;
+        fd = -1;
+    }
+
+    bool valid() const {
+        return nullptr != sqes;
+    }
+
+    // Submit up to sq_entries reads and wait for all of them
+    // Returns false if the ring failed, in which case none of the reads is done
+    // and the ring is closed
+    bool read(read_req_t* reqs, unsigned n) {
+        unsigned tail = *sq_tail;
+        for (unsigned i = 0; i < n; i++) {
+            unsigned idx = tail & sq_mask;
+            io_uring_sqe* sqe = &sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            apr_os_file_t fd;
+            apr_os_file_get(&fd, reqs[i].file->file);
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->addr = reinterpret_cast<uint64_t>(reqs[i].buffer);
+            sqe->len = static_cast<uint32_t>(reqs[i].size);
+            sqe->off = static_cast<uint64_t>(reqs[i].offset);
+            sqe->user_data = i;
+            sq_array[idx] = idx;
+            tail++;
+        }
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+        unsigned submitted = 0, completed = 0;
+        while (completed < n) {
+            long ret = syscall(__NR_io_uring_enter, fd, n - submitted, n - completed,
+                IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (ret < 0) {
+                if (EINTR == errno || EAGAIN == errno || EBUSY == errno)
+                    continue;
+                // Broken ring, drop it and redo all reads synchronously
+                for (unsigned i = 0; i < n; i++)
+                    reqs[i].nread = 0;
+                close_ring();
+                uring_disabled = true;
+                return false;
+            }
+            submitted += static_cast<unsigned>(ret);
+
+            unsigned head = *cq_head;
+            unsigned ctail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != ctail; head++) {
+                const io_uring_cqe& cqe = cqes[head & cq_mask];
+                // Errors, including unsupported opcode, are retried synchronously
+                if (cqe.res > 0)
+                    reqs[cqe.user_data].nread = cqe.res;
+                completed++;
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        }
+        return true;
+    }
+
+    int fd;
+    bool single;
+    void* sq_ptr;
+    void* cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    io_uring_sqe* sqes;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe* cqes;
+};
+
+static uring_t* get_ring() {
+    if (uring_disabled)
+        return nullptr;
+    static thread_local uring_t ring;
+    if (!ring.valid()) {
+        uring_disabled = true;
+        return nullptr;
+    }
+    return &ring;
+}
+
+#endif
+
+void batch_pread(read_req_t* reqs, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        reqs[i].nread = 0;
+
+#if defined(HAVE_URING)
+    uring_t* ring = (n > 1) ? get_ring() : nullptr;
+    for (size_t i = 0; ring && i < n; i += ring->sq_entries) {
+        unsigned count = static_cast<unsigned>(min<size_t>(ring->sq_entries, n - i));
+        if (!ring->read(reqs + i, count))
+            break;
+    }
+#endif
+
+    // Synchronous reads, or the remainder of short reads
+    for (size_t i = 0; i < n; i++)
+        finish_read(reqs[i]);
+}
+
+int vfile_pread_batch(request_rec* r, const vfile_t& vf, const apr_off_t* offsets,
+    storage_manager* dsts, size_t n, const char** msg)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (vf.range.size && (static_cast<apr_uint64_t>(offsets[i]) < vf.range.offset
+            || offsets[i] + dsts[i].size > vf.range.offset + vf.range.size))
+        {
+            if (msg)
+                *msg = "Read outside of the file range";
+            return HTTP_RANGE_NOT_SATISFIABLE;
+        }
+    }
+
+    apr_status_t stat;
+    cached_file_t* cf = acquire_file(vf.name, &stat);
+    if (!cf) {
+        if (!APR_STATUS_IS_ENOENT(stat)) {
+            if (msg)
+                *msg = apr_psprintf(r->pool, "Can't open %s, %pm", vf.name, &stat);
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+        // Not a local file, one at a time
+        for (size_t i = 0; i < n; i++)
+            if (0 == range_read(r, vf.name, offsets[i], dsts[i], 4, msg))
+                return HTTP_NOT_FOUND;
+        return APR_SUCCESS;
+    }
+
+    auto reqs = static_cast<read_req_t*>(apr_palloc(r->pool, n * sizeof(read_req_t)));
+    for (size_t i = 0; i < n; i++) {
+        reqs[i].file = cf;
+        reqs[i].offset = offsets[i];
+        reqs[i].size = dsts[i].size;
+        reqs[i].buffer = dsts[i].buffer;
+    }
+    batch_pread(reqs, n);
+    release_file(cf);
+
+    for (size_t i = 0; i < n; i++) {
+        if (reqs[i].nread != reqs[i].size) {
+            if (msg)
+                *msg = apr_psprintf(r->pool, "Short read from %s", vf.name);
+            return HTTP_NOT_FOUND;
+        }
+    }
+    return APR_SUCCESS;
+}
+
+NS_AHTSE_END
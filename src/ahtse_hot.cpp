@@ -0,0 +1,336 @@
+/*
+* ahtse_hot.cpp
+*
+* Hot tiles, tracking of the most requested tiles and cache warm up
+*
+* Tile requests are counted per layer in a count-min sketch, which has a fixed size. The
+* tiles with the highest estimates are kept as candidates, pruned to the configured size.
+* The number of layers is capped, they are added once and never removed, so finding the layer
+* of a request doesn't take a lock.
+* Every period a background thread saves the hot set to a file, replacing it, then halves all
+* the counts, so the hot set follows the traffic. Each process saves its own view, which is
+* a sample of the same traffic
+* The warmer thread requests the saved hot set from the server itself, at a limited rate, so
+* all the caches on the way are filled. A lock file makes sure only one process warms up
+* at a time. Both threads start from hot_tiles_start, or on the first tile request
+*
+* (C) Lucian Plesea 2019-2021
+*
+*/
+
+#include "ahtse.h"
+#include <httpd.h>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+using namespace std;
+NS_ICD_USE
+
+NS_AHTSE_START
+
+// Sketch rows and counters per row
+#define HT_DEPTH 4
+#define HT_WIDTH 4096
+// Largest line in the hot set file
+#define HT_MAX_LINE 2048
+// Marks the warm up requests, they are not counted
+#define HT_WARM_HEADER "X-AHTSE-Warmup"
+// Layers tracked, requests for other layers are not counted
+#define HT_MAX_LAYERS 64
+
+struct hot_layer_t {
+    hot_layer_t(const string& name) : name(name), sketch(HT_DEPTH * HT_WIDTH, 0) {}
+    const string name;
+    mutex lock;
+    vector<apr_uint32_t> sketch;
+    // Candidates and their estimated counts
+    unordered_map<string, apr_uint32_t> top;
+};
+
+// The layers are only added, the count is published after the slot is set
+// Plain pointers, the background threads might still run when the statics are destroyed
+static mutex ht_lock;
+static hot_layer_t* ht_layers[HT_MAX_LAYERS];
+static atomic<size_t> ht_nlayers(0);
+// Changes when the configuration does, older background threads exit
+static atomic<unsigned int> ht_generation(0);
+static string ht_path, ht_warm_url;
+static apr_size_t ht_size;
+static apr_time_t ht_period;
+static double ht_rate;
+static atomic<bool> ht_enabled(false);
+static atomic<bool> ht_counted(false);
+static atomic<bool> ht_started(false);
+
+static uint64_t fnv1a(const char* data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    while (size--)
+        hash = (hash ^ static_cast<unsigned char>(*data++)) * 0x100000001b3ULL;
+    return hash;
+}
+
+// Saves the hot set when the pool is cleaned up
+static apr_status_t hot_tiles_cleanup(void*) {
+    hot_tiles_save();
+    return APR_SUCCESS;
+}
+
+const char* set_hot_tiles(apr_pool_t* p, const hot_tiles_conf_t& conf) {
+    lock_guard<mutex> guard(ht_lock);
+    // Called during configuration, before any requests
+    ht_enabled = false;
+    ht_started = false;
+    ht_generation++;
+    for (size_t i = 0; i < ht_nlayers; i++) {
+        delete ht_layers[i];
+        ht_layers[i] = nullptr;
+    }
+    ht_nlayers = 0;
+    if (!conf.path || !*conf.path)
+        return nullptr;
+    if (conf.warm_url && !is_http_url(conf.warm_url))
+        return "The hot tiles warm up URL has to start with http://";
+    if (0 == conf.size || conf.period <= 0)
+        return "Invalid hot tiles size or period";
+
+    ht_path = conf.path;
+    ht_warm_url = conf.warm_url ? conf.warm_url : "";
+    // No trailing slash, the tile paths start with one
+    while (!ht_warm_url.empty() && '/' == ht_warm_url.back())
+        ht_warm_url.pop_back();
+    ht_size = conf.size;
+    ht_period = conf.period;
+    ht_rate = conf.rate > 0 ? conf.rate : 1;
+    ht_enabled = true;
+    apr_pool_cleanup_register(p, nullptr, hot_tiles_cleanup, apr_pool_cleanup_null);
+    return nullptr;
+}
+
+// Tile paths are split at /tile/, the layer is the part before it, otherwise the folder
+// Returns nullptr when there are too many layers
+static hot_layer_t* ht_layer(const char* path) {
+    const char* split = strstr(path, "/tile/");
+    if (!split)
+        split = strrchr(path, '/');
+    size_t len = split ? split - path : strlen(path);
+    size_t n = ht_nlayers;
+    for (size_t i = 0; i < n; i++)
+        if (ht_layers[i]->name.size() == len && !ht_layers[i]->name.compare(0, len, path, len))
+            return ht_layers[i];
+
+    lock_guard<mutex> guard(ht_lock);
+    // Might have been added in the mean time
+    for (size_t i = n; i < ht_nlayers; i++)
+        if (ht_layers[i]->name.size() == len && !ht_layers[i]->name.compare(0, len, path, len))
+            return ht_layers[i];
+    if (HT_MAX_LAYERS == ht_nlayers)
+        return nullptr;
+    hot_layer_t* layer = new hot_layer_t(string(path, len));
+    ht_layers[ht_nlayers] = layer;
+    ht_nlayers++;
+    return layer;
+}
+
+// Keeps the n candidates with the highest counts
+static void prune(unordered_map<string, apr_uint32_t>& top, size_t n) {
+    if (top.size() <= n)
+        return;
+    typedef unordered_map<string, apr_uint32_t>::iterator it_t;
+    vector<it_t> order;
+    order.reserve(top.size());
+    for (auto it = top.begin(); it != top.end(); it++)
+        order.push_back(it);
+    nth_element(order.begin(), order.begin() + n, order.end(),
+        [](const it_t& a, const it_t& b) { return a->second > b->second; });
+    for (size_t i = n; i < order.size(); i++)
+        top.erase(order[i]);
+}
+
+// Halves all the counts
+static void age() {
+    for (size_t i = 0; i < ht_nlayers; i++) {
+        hot_layer_t* layer = ht_layers[i];
+        lock_guard<mutex> guard(layer->lock);
+        for (auto& c : layer->sketch)
+            c >>= 1;
+        for (auto it = layer->top.begin(); it != layer->top.end();) {
+            it->second >>= 1;
+            it = (0 == it->second) ? layer->top.erase(it) : next(it);
+        }
+    }
+}
+
+// Saves and ages the counts every period, until the configuration changes
+static void maintainer(unsigned int generation) {
+    auto step = chrono::microseconds(min<apr_time_t>(ht_period, apr_time_from_sec(1)));
+    auto due = chrono::steady_clock::now() + chrono::microseconds(ht_period);
+    for (;;) {
+        this_thread::sleep_for(min<chrono::steady_clock::duration>(step,
+            due - chrono::steady_clock::now()));
+        if (generation != ht_generation || !ht_enabled)
+            return;
+        if (chrono::steady_clock::now() < due)
+            continue;
+        hot_tiles_save();
+        age();
+        due += chrono::microseconds(ht_period);
+    }
+}
+
+static void warmer();
+
+void hot_tiles_start() {
+    if (!ht_enabled || ht_started.exchange(true))
+        return;
+    thread(maintainer, static_cast<unsigned int>(ht_generation)).detach();
+    if (!ht_warm_url.empty())
+        thread(warmer).detach();
+}
+
+void hot_tile_record(request_rec* r) {
+    // Only client requests count
+    if (!ht_enabled || r->main || apr_table_get(r->headers_in, HT_WARM_HEADER))
+        return;
+    // When not started from the child init
+    if (!ht_started)
+        hot_tiles_start();
+
+    const char* path = r->uri;
+    size_t len = 0;
+    // The path is sent back in a request line, it can't have spaces or control characters
+    for (; path[len]; len++)
+        if (static_cast<unsigned char>(path[len]) <= ' ')
+            return;
+    uint64_t hash = fnv1a(path, len);
+    apr_uint32_t h1 = static_cast<apr_uint32_t>(hash);
+    apr_uint32_t h2 = static_cast<apr_uint32_t>(hash >> 32) | 1;
+    hot_layer_t* layer = ht_layer(path);
+    if (!layer)
+        return;
+    {
+        lock_guard<mutex> guard(layer->lock);
+        apr_uint32_t estimate = ~0u;
+        for (apr_uint32_t i = 0; i < HT_DEPTH; i++) {
+            apr_uint32_t& c = layer->sketch[i * HT_WIDTH + (h1 + i * h2) % HT_WIDTH];
+            if (c < ~0u)
+                c++;
+            estimate = min(estimate, c);
+        }
+        layer->top[string(path, len)] = estimate;
+        // Pruning is amortized, the list can grow to twice the size
+        if (layer->top.size() > 2 * ht_size)
+            prune(layer->top, ht_size);
+    }
+    ht_counted = true;
+}
+
+apr_status_t hot_tiles_save() {
+    // Nothing to save, a process which didn't serve tiles doesn't replace the file
+    if (!ht_enabled || !ht_counted)
+        return APR_SUCCESS;
+
+    vector<pair<apr_uint32_t, string>> tiles;
+    string path;
+    {
+        lock_guard<mutex> guard(ht_lock);
+        path = ht_path;
+    }
+    for (size_t i = 0; i < ht_nlayers; i++) {
+        hot_layer_t* layer = ht_layers[i];
+        lock_guard<mutex> guard(layer->lock);
+        prune(layer->top, ht_size);
+        for (auto& it : layer->top)
+            tiles.push_back(make_pair(it.second, it.first));
+    }
+    sort(tiles.begin(), tiles.end(), greater<pair<apr_uint32_t, string>>());
+
+    string content;
+    for (auto& t : tiles)
+        content.append(to_string(t.first)).append(" ").append(t.second).append("\n");
+
+    apr_pool_t* pool;
+    apr_status_t stat = apr_pool_create(&pool, nullptr);
+    if (APR_SUCCESS != stat)
+        return stat;
+    // Written next to it, then renamed, so readers never see a partial file
+    const char* tname = apr_psprintf(pool, "%s.%" APR_UINT64_T_FMT, path.c_str(),
+        static_cast<apr_uint64_t>(apr_time_now() ^ hash<thread::id>()(this_thread::get_id())));
+    apr_file_t* f;
+    stat = apr_file_open(&f, tname, APR_FOPEN_WRITE | APR_FOPEN_CREATE | APR_FOPEN_TRUNCATE
+        | APR_FOPEN_BINARY, APR_OS_DEFAULT, pool);
+    if (APR_SUCCESS == stat) {
+        apr_size_t written;
+        stat = apr_file_write_full(f, content.data(), content.size(), &written);
+        apr_file_close(f);
+        if (APR_SUCCESS == stat)
+            stat = apr_file_rename(tname, path.c_str(), pool);
+        if (APR_SUCCESS != stat)
+            apr_file_remove(tname, pool);
+    }
+    apr_pool_destroy(pool);
+    return stat;
+}
+
+// Requests the saved hot set from this server, hottest first
+static void warmer() {
+    string path, url;
+    double rate;
+    {
+        lock_guard<mutex> guard(ht_lock);
+        path = ht_path;
+        url = ht_warm_url;
+        rate = ht_rate;
+    }
+
+    apr_pool_t* pool;
+    if (APR_SUCCESS != apr_pool_create(&pool, nullptr))
+        return;
+    // The lock is held as long as this process lives, other processes don't warm up
+    apr_file_t* lock;
+    if (APR_SUCCESS != apr_file_open(&lock, apr_pstrcat(pool, path.c_str(), ".lock", NULL),
+        APR_FOPEN_WRITE | APR_FOPEN_CREATE, APR_OS_DEFAULT, pool)
+        || APR_SUCCESS != apr_file_lock(lock, APR_FLOCK_EXCLUSIVE | APR_FLOCK_NONBLOCK))
+    {
+        apr_pool_destroy(pool);
+        return;
+    }
+
+    vector<string> tiles;
+    apr_file_t* f;
+    if (APR_SUCCESS == apr_file_open(&f, path.c_str(), APR_FOPEN_READ, APR_OS_DEFAULT, pool)) {
+        char line[HT_MAX_LINE];
+        while (APR_SUCCESS == apr_file_gets(line, sizeof(line), f)) {
+            char* tile = strchr(line, ' ');
+            if (!tile || '/' != tile[1])
+                continue;
+            tile[1 + strcspn(tile + 1, "\r\n")] = 0;
+            tiles.push_back(tile + 1);
+        }
+        apr_file_close(f);
+    }
+
+    apr_table_t* headers = apr_table_make(pool, 1);
+    apr_table_setn(headers, HT_WARM_HEADER, "1");
+    // The content is not needed, it is only read
+    receive_chain body(pool, 64 * 1024, ~static_cast<apr_size_t>(0));
+    body.sink = [](const char*, apr_size_t) { return true; };
+    auto interval = chrono::microseconds(static_cast<apr_int64_t>(1e6 / rate));
+    for (auto& tile : tiles) {
+        if (!ht_enabled)
+            break;
+        auto start = chrono::steady_clock::now();
+        body.reset();
+        http_result_t result;
+        http_get((url + tile).c_str(), body, result, headers);
+        this_thread::sleep_until(start + interval);
+    }
+    // The lock file stays open
+}
+
+NS_AHTSE_END
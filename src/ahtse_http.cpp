@@ -0,0 +1,443 @@
+/*
+* ahtse_http.cpp
+*
+* Direct HTTP/1.1 client, for sources configured as http:// URLs
+* Connections are kept open in a per process pool for each host and reused, so remote
+* reads don't pay for a subrequest and don't depend on mod_proxy connection reuse
+*
+* (C) Lucian Plesea 2019-2021
+*
+*/
+
+#include "ahtse.h"
+#include <apr_network_io.h>
+#include <apr_strings.h>
+#include <mutex>
+#include <unordered_map>
+#include <algorithm>
+#include <atomic>
+
+using namespace std;
+NS_ICD_USE
+
+NS_AHTSE_START
+
+#define HTTP_IDLE_MAX 16 // Idle connections per host
+#define HTTP_IDLE_TIMEOUT 30 // Seconds, older idle connections are closed
+#define HTTP_IO_TIMEOUT 30 // Seconds, for connect, send and receive
+#define HTTP_RBUF 16384 // Receive buffer, for status and headers
+#define HTTP_MAX_LINE 8192
+
+struct http_conn_t {
+    apr_pool_t* pool; // Owns the socket
+    apr_socket_t* sock;
+    apr_time_t last_used;
+    // Received data not yet consumed is between pos and end
+    size_t pos, end;
+    char rbuf[HTTP_RBUF];
+};
+
+static mutex conns_lock;
+static unordered_map<string, vector<http_conn_t*>> idle_conns;
+static atomic<size_t> idle_limit(HTTP_IDLE_MAX);
+
+void set_http_idle_limit(size_t n) {
+    idle_limit = n;
+}
+
+static void conn_close(http_conn_t* c) {
+    apr_pool_t* pool = c->pool;
+    delete c;
+    apr_pool_destroy(pool); // Closes the socket
+}
+
+static http_conn_t* conn_open(const string& host, apr_port_t port, apr_status_t* pstat) {
+    apr_pool_t* pool;
+    apr_status_t stat = apr_pool_create(&pool, nullptr);
+    if (APR_SUCCESS != stat) {
+        *pstat = stat;
+        return nullptr;
+    }
+
+    apr_sockaddr_t* sa = nullptr;
+    apr_socket_t* sock = nullptr;
+    stat = apr_sockaddr_info_get(&sa, host.c_str(), APR_UNSPEC, port, 0, pool);
+    if (APR_SUCCESS == stat)
+        stat = apr_socket_create(&sock, sa->family, SOCK_STREAM, APR_PROTO_TCP, pool);
+    if (APR_SUCCESS == stat) {
+        apr_socket_timeout_set(sock, apr_time_from_sec(HTTP_IO_TIMEOUT));
+        apr_socket_opt_set(sock, APR_TCP_NODELAY, 1);
+        stat = apr_socket_connect(sock, sa);
+    }
+    if (APR_SUCCESS != stat) {
+        apr_pool_destroy(pool);
+        *pstat = stat;
+        return nullptr;
+    }
+
+    auto c = new http_conn_t;
+    c->pool = pool;
+    c->sock = sock;
+    c->pos = c->end = 0;
+    c->last_used = apr_time_now();
+    return c;
+}
+
+// An idle connection to the host, or null
+static http_conn_t* conn_get(const string& key) {
+    apr_time_t oldest = apr_time_now() - apr_time_from_sec(HTTP_IDLE_TIMEOUT);
+    vector<http_conn_t*> expired;
+    http_conn_t* c = nullptr;
+    {
+        lock_guard<mutex> guard(conns_lock);
+        auto it = idle_conns.find(key);
+        if (it != idle_conns.end()) {
+            auto& conns = it->second;
+            while (!c && !conns.empty()) {
+                c = conns.back();
+                conns.pop_back();
+                if (c->last_used < oldest) {
+                    expired.push_back(c);
+                    c = nullptr;
+                }
+            }
+        }
+    }
+    for (auto e : expired)
+        conn_close(e);
+    return c;
+}
+
+static void conn_put(const string& key, http_conn_t* c) {
+    c->last_used = apr_time_now();
+    c->pos = c->end = 0;
+    {
+        lock_guard<mutex> guard(conns_lock);
+        auto& conns = idle_conns[key];
+        if (conns.size() < idle_limit) {
+            conns.push_back(c);
+            return;
+        }
+    }
+    conn_close(c);
+}
+
+// Receives more data, returns APR_EOF if the peer closed the connection
+static apr_status_t conn_fill(http_conn_t* c) {
+    if (c->pos == c->end)
+        c->pos = c->end = 0;
+    if (c->end == HTTP_RBUF) {
+        memmove(c->rbuf, c->rbuf + c->pos, c->end - c->pos);
+        c->end -= c->pos;
+        c->pos = 0;
+    }
+    apr_size_t len = HTTP_RBUF - c->end;
+    apr_status_t stat = apr_socket_recv(c->sock, c->rbuf + c->end, &len);
+    c->end += len;
+    if (len)
+        return APR_SUCCESS;
+    return (APR_SUCCESS == stat) ? APR_EOF : stat;
+}
+
+// Reads a line, without the line terminator
+static apr_status_t conn_line(http_conn_t* c, string& line) {
+    line.clear();
+    for (;;) {
+        const char* start = c->rbuf + c->pos;
+        auto nl = static_cast<const char*>(memchr(start, '\n', c->end - c->pos));
+        if (nl) {
+            line.append(start, nl);
+            c->pos = nl - c->rbuf + 1;
+            if (!line.empty() && '\r' == line.back())
+                line.pop_back();
+            return APR_SUCCESS;
+        }
+        line.append(start, c->end - c->pos);
+        c->pos = c->end;
+        if (line.size() > HTTP_MAX_LINE)
+            return APR_EGENERAL;
+        apr_status_t stat = conn_fill(c);
+        if (APR_SUCCESS != stat)
+            return stat;
+    }
+}
+
+// Reads exactly n bytes into dst, large reads go straight to dst
+static apr_status_t conn_read(http_conn_t* c, char* dst, size_t n) {
+    while (n) {
+        if (c->pos == c->end) {
+            if (n >= HTTP_RBUF / 2) {
+                apr_size_t len = n;
+                apr_status_t stat = apr_socket_recv(c->sock, dst, &len);
+                if (0 == len)
+                    return (APR_SUCCESS == stat) ? APR_EOF : stat;
+                dst += len;
+                n -= len;
+                continue;
+            }
+            apr_status_t stat = conn_fill(c);
+            if (APR_SUCCESS != stat)
+                return stat;
+        }
+        size_t len = min(n, c->end - c->pos);
+        memcpy(dst, c->rbuf + c->pos, len);
+        c->pos += len;
+        dst += len;
+        n -= len;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t conn_send(http_conn_t* c, const string& data) {
+    const char* p = data.c_str();
+    apr_size_t left = data.size();
+    while (left) {
+        apr_size_t len = left;
+        apr_status_t stat = apr_socket_send(c->sock, p, &len);
+        if (APR_SUCCESS != stat)
+            return stat;
+        p += len;
+        left -= len;
+    }
+    return APR_SUCCESS;
+}
+
+// Reads n bytes of body into the chain, stops when it is full
+static apr_status_t body_read(http_conn_t* c, receive_chain& body, size_t n) {
+    while (n) {
+        apr_size_t len;
+        char* dst = body.reserve(len);
+        if (!dst) {
+            body.overflow = true;
+            break;
+        }
+        len = min(len, n);
+        apr_status_t stat = conn_read(c, dst, len);
+        if (APR_SUCCESS != stat)
+            return stat;
+        body.commit(len);
+        n -= len;
+    }
+    return APR_SUCCESS;
+}
+
+static int add_header(void* rec, const char* key, const char* value) {
+    static_cast<string*>(rec)->append(key).append(": ").append(value).append("\r\n");
+    return 1;
+}
+
+static bool header_is(const string& line, const char* name, string& value) {
+    size_t len = strlen(name);
+    if (line.size() <= len || ':' != line[len] || ap_cstr_casecmpn(line.c_str(), name, len))
+        return false;
+    size_t start = line.find_first_not_of(" \t", len + 1);
+    value = (start == string::npos) ? string() : line.substr(start);
+    return true;
+}
+
+// Sends the request and reads the response, keep is set if the connection can be reused
+static apr_status_t http_exchange(http_conn_t* c, const string& req, receive_chain& body,
+    http_result_t& result, bool& keep, const char** error)
+{
+    keep = false;
+    apr_status_t stat = conn_send(c, req);
+    if (APR_SUCCESS != stat)
+        return stat;
+
+    string line, value;
+    int major = 0, minor = 0;
+    do { // Skip interim responses
+        stat = conn_line(c, line);
+        if (APR_SUCCESS != stat)
+            return stat;
+        if (3 != sscanf(line.c_str(), "HTTP/%d.%d %d", &major, &minor, &result.status)) {
+            *error = "Malformed HTTP status line";
+            return APR_EGENERAL;
+        }
+        bool interim = (result.status >= 100 && result.status < 200);
+        bool persistent = (major > 1 || (1 == major && minor >= 1));
+        bool chunked = false;
+        apr_int64_t length = -1;
+        result.ETag.clear();
+        result.location.clear();
+        result.content_type.clear();
+        result.last_modified.clear();
+        result.cache_control.clear();
+        result.expires.clear();
+        result.content_encoding.clear();
+        result.total = 0;
+
+        for (;;) {
+            stat = conn_line(c, line);
+            if (APR_SUCCESS != stat)
+                return stat;
+            if (line.empty())
+                break;
+            if (header_is(line, "Content-Length", value))
+                length = apr_atoi64(value.c_str());
+            else if (header_is(line, "Transfer-Encoding", value))
+                chunked = (string::npos != value.find("chunked"));
+            else if (header_is(line, "Connection", value)) {
+                if (!ap_cstr_casecmpn(value.c_str(), "close", 5))
+                    persistent = false;
+                else if (!ap_cstr_casecmpn(value.c_str(), "keep-alive", 10))
+                    persistent = true;
+            }
+            else if (header_is(line, "Content-Type", value))
+                result.content_type = value;
+            else if (header_is(line, "Last-Modified", value))
+                result.last_modified = value;
+            else if (header_is(line, "Cache-Control", value))
+                result.cache_control = value;
+            else if (header_is(line, "Expires", value))
+                result.expires = value;
+            else if (header_is(line, "Content-Encoding", value))
+                result.content_encoding = value;
+            else if (header_is(line, "ETag", value))
+                result.ETag = value;
+            else if (header_is(line, "Location", value))
+                result.location = value;
+            else if (header_is(line, "Content-Range", value)) {
+                size_t slash = value.find('/');
+                if (slash != string::npos)
+                    result.total = static_cast<apr_size_t>(apr_atoi64(value.c_str() + slash + 1));
+            }
+        }
+        if (interim)
+            continue;
+        result.length = length;
+
+        // The content is replaced only by a response with content
+        if (HTTP_NOT_MODIFIED != result.status)
+            body.reset();
+
+        if (HTTP_NO_CONTENT == result.status || HTTP_NOT_MODIFIED == result.status)
+            length = 0;
+
+        if (chunked) {
+            for (;;) {
+                stat = conn_line(c, line);
+                if (APR_SUCCESS != stat)
+                    return stat;
+                size_t csize = static_cast<size_t>(strtoull(line.c_str(), nullptr, 16));
+                if (0 == csize)
+                    break;
+                stat = body_read(c, body, csize);
+                if (APR_SUCCESS != stat)
+                    return stat;
+                if (body.overflow)
+                    break;
+                stat = conn_line(c, line); // Chunk terminator
+                if (APR_SUCCESS != stat)
+                    return stat;
+            }
+            // Trailers
+            while (!body.overflow && APR_SUCCESS == (stat = conn_line(c, line)) && !line.empty());
+            if (APR_SUCCESS != stat)
+                return stat;
+        }
+        else if (length >= 0) {
+            body.expect(static_cast<apr_size_t>(length));
+            stat = body_read(c, body, static_cast<size_t>(length));
+            if (APR_SUCCESS != stat)
+                return stat;
+        }
+        else { // Until the connection closes
+            persistent = false;
+            while (!body.overflow) {
+                if (c->pos == c->end) {
+                    stat = conn_fill(c);
+                    if (APR_EOF == stat)
+                        break;
+                    if (APR_SUCCESS != stat)
+                        return stat;
+                }
+                stat = body_read(c, body, c->end - c->pos);
+                if (APR_SUCCESS != stat)
+                    return stat;
+            }
+        }
+
+        result.overflow = body.overflow;
+        // Unread data left on the connection, it can't be reused
+        keep = persistent && !body.overflow;
+        return APR_SUCCESS;
+    } while (true);
+}
+
+apr_status_t http_get(const char* url, storage_manager& dst, http_result_t& result,
+    const apr_table_t* headers, const char** msg)
+{
+    receive_chain body(dst);
+    apr_status_t stat = http_get(url, body, result, headers, msg);
+    if (HTTP_NOT_MODIFIED != result.status)
+        dst.size = body.size;
+    return stat;
+}
+
+apr_status_t http_get(const char* url, receive_chain& dst, http_result_t& result,
+    const apr_table_t* headers, const char** msg)
+{
+    if (!is_http_url(url)) {
+        if (msg)
+            *msg = "Not an http:// URL";
+        return APR_EINVAL;
+    }
+
+    // Split in host, port and path
+    const char* hstart = url + 7;
+    const char* path = strchr(hstart, '/');
+    string hostport = path ? string(hstart, path) : string(hstart);
+    if (!path)
+        path = "/";
+    string host(hostport);
+    apr_port_t port = 80;
+    size_t colon = hostport.rfind(':');
+    if (colon != string::npos && hostport.find(']', colon) == string::npos) {
+        host = hostport.substr(0, colon);
+        port = static_cast<apr_port_t>(atoi(hostport.c_str() + colon + 1));
+    }
+    // IPv6 literal
+    if (host.size() > 2 && '[' == host.front() && ']' == host.back())
+        host = host.substr(1, host.size() - 2);
+
+    string req("GET ");
+    req.append(path).append(" HTTP/1.1\r\nHost: ").append(hostport).append("\r\n");
+    if (headers)
+        apr_table_do(add_header, &req, headers, NULL);
+    req.append("\r\n");
+
+    const char* error = nullptr;
+    apr_status_t stat = APR_SUCCESS;
+    // A reused connection might have been closed by the server, retry once on a new one
+    for (int attempt = 0; attempt < 2; attempt++) {
+        http_conn_t* c = conn_get(hostport);
+        bool reused = (nullptr != c);
+        if (!c) {
+            c = conn_open(host, port, &stat);
+            if (!c) {
+                if (msg)
+                    *msg = "Can't connect to remote host";
+                return stat;
+            }
+        }
+
+        bool keep = false;
+        stat = http_exchange(c, req, dst, result, keep, &error);
+        if (keep)
+            conn_put(hostport, c);
+        else
+            conn_close(c);
+
+        // Content already passed to a sink can't be taken back
+        if (APR_SUCCESS == stat || !reused || (dst.sink && dst.size))
+            break;
+        result.status = 0;
+    }
+
+    if (APR_SUCCESS != stat && msg)
+        *msg = error ? error : "HTTP connection error";
+    return stat;
+}
+
+NS_AHTSE_END
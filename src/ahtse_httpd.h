@@ -19,6 +19,7 @@
 #include <apr_want.h>
 #include <apr_strings.h>
 #include <apr_hash.h>
+#include <apr_file_io.h>
 
 #if APR_SUCCESS != 0
 #error "APR_SUCCESS is not zero"
@@ -59,6 +60,13 @@ struct vfile_t {
 
 #define READ_RIGHTS APR_FOPEN_READ | APR_FOPEN_BINARY | APR_FOPEN_LARGEFILE
 
+// Read rights for random access, see httpd_patches/apr_fopen_random
+#if defined(APR_FOPEN_RANDOM)
+#define RANDOM_READ_RIGHTS READ_RIGHTS | APR_FOPEN_RANDOM
+#else
+#define RANDOM_READ_RIGHTS READ_RIGHTS
+#endif
+
 // removes and returns the value of the last element from an apr_array, as type
 // will crash by dereferencing the null pointer if the array is empty
 #define ARRAY_POP(arr, type) (*(type *)(apr_array_pop(arr)))
@@ -144,22 +152,103 @@ struct range_arg {
     bool valid;
 };
 
-// A structure used to issue a sub-request and return the result, using mod_receive
+//
+// Growable receive buffer, a chain of segments allocated from a pool
+// The first segment has the hint size and each new one is twice as large as the previous,
+// until maxsize is reached. Memory use is proportional to the content size
+// Built from a storage_manager, it is a single fixed segment, which doesn't grow
+// With a sink, the content is passed on as it is committed and the first segment is reused,
+// only the size is kept
+//
+struct receive_chain {
+    receive_chain(apr_pool_t* p, apr_size_t hint, apr_size_t maxsize) :
+        pool(p), hint(hint), maxsize(maxsize), size(0), overflow(0), room(0), last(0), first(0) {}
+    DLL_PUBLIC receive_chain(const ICD::storage_manager& buffer);
+
+    // Appends data, returns false and sets overflow if maxsize is reached
+    DLL_PUBLIC bool append(const void* data, apr_size_t len);
+
+    // Free space at the end, allocates a new segment if needed
+    // Sets len to the available size, returns nullptr when maxsize is reached
+    DLL_PUBLIC char* reserve(apr_size_t& len);
+
+    // Marks len bytes in the space returned by reserve as content
+    void commit(apr_size_t len) {
+        size += len;
+        if (sink) {
+            // When the sink fails, no more content is accepted
+            if (!sink(static_cast<const char*>(segments.back().buffer), len))
+                maxsize = size;
+            return;
+        }
+        segments.back().size += len;
+        room -= len;
+    }
+
+    // When the content size is known before any data, the first segment is allocated with that size
+    void expect(apr_size_t total) {
+        if (segments.empty() && total && !sink)
+            hint = (total < maxsize) ? total : maxsize;
+    }
+
+    // Content as a single buffer, copies only if there is more than one segment
+    DLL_PUBLIC ICD::storage_manager contiguous();
+
+    // Copies up to len bytes of content starting at offset, returns the number copied
+    DLL_PUBLIC apr_size_t peek(apr_size_t offset, void* dst, apr_size_t len) const;
+
+    // Drops the content, keeps the first segment
+    DLL_PUBLIC void reset();
+
+    apr_pool_t* pool;
+    apr_size_t hint, maxsize;
+    apr_size_t size; // Content size
+    int overflow; // The content was larger than maxsize, it is truncated
+    std::vector<ICD::storage_manager> segments; // The size is the used part
+    apr_size_t room; // Free space in the last segment
+    apr_size_t last; // Size of the last segment
+    apr_size_t first; // Size of the first segment
+    // Optional, receives the content instead of the segments, returns false to stop
+    std::function<bool(const char*, apr_size_t)> sink;
+};
+
+// A structure used to issue a sub-request and return the result, in a receive_chain
 // supports range, optional INFLATE the response, retries (for s3)
 struct subr {
-    subr(request_rec* r) : main(r), tries(4) {};
+    subr(request_rec* r) : main(r), tries(4), unpack(ZIP_NONE) {};
 
     // Returns APR_SUCCESS or HTTP error code
+    // Concurrent fetches of the same url, range and agent are coalesced
     DLL_PUBLIC int fetch(const char* url, ICD::storage_manager& dst);
 
+    // Same, receiving in a chain which grows up to its maxsize
+    DLL_PUBLIC int fetch(const char* url, receive_chain& dst);
+
+    // Single fetch, without coalescing
+    int fetch_once(const char* url, receive_chain& dst);
+
+    // Range read from the disk cache, returns APR_SUCCESS or APR_NOTFOUND
+    // key is the cache key of url
+    int disk_fetch(const char* url, const char* key, receive_chain& dst);
+
     std::string agent; // input
+    // input, sent as If-None-Match. If it matches, fetch returns HTTP_NOT_MODIFIED
+    // and dst is not changed
+    std::string known_ETag;
     std::string error_message;
     std::string ETag; // output
+    std::string validator; // output, the source ETag or Last-Modified, if any
     request_rec* main;
     range_arg range;
     int tries;
+    // input, ZIP_ZLIB or ZIP_DEFLATE if the content is compressed that way, these have no
+    // signature. gzip and zstd content is always decompressed
+    zip_t unpack;
 };
 
+// Turns coalescing of concurrent identical fetches on or off, it is on by default
+DLL_PUBLIC void set_fetch_coalescing(int on);
+
 // Builds a MLRC URL to fetch a tile
 DLL_PUBLIC char* tile_url(apr_pool_t* p, const char* src, ICD::sz5 tile, const char* suffix);
 
@@ -172,8 +261,31 @@ DLL_PUBLIC char* tile_url(apr_pool_t* p, const char* src, ICD::sz5 tile, const c
 // If dst is too small but otherwise it was a success, the buffer is full and
 // returns 413 (HTTP_REQUEST_ENTITY_TOO_LARGE)
 //
+// Concurrent calls for the same path wait for the first one and receive a copy of
+// its response, including errors
+//
+// If known_ETag is not null, it is sent as If-None-Match. When the content still has
+// that ETag, returns HTTP_NOT_MODIFIED and dst is not changed
+//
 DLL_PUBLIC int get_response(request_rec* r, const char* lcl_path, ICD::storage_manager& dst,
-    char** psETag = nullptr);
+    char** psETag = nullptr, const char* known_ETag = nullptr);
+
+// Same, receiving in a chain, so the memory used is proportional to the content size
+// Doesn't use mod_receive. Content larger than dst.maxsize returns 413
+DLL_PUBLIC int get_response(request_rec* r, const char* lcl_path, receive_chain& dst,
+    char** psETag = nullptr, const char* known_ETag = nullptr);
+
+//
+// Sends the response for the local path or http:// URL to the client as it arrives, without
+// keeping the content. The status, ETag, type and validators are those of the source and
+// the client If-None-Match is passed on
+// Returns OK once content was sent. Otherwise nothing was sent and the source status
+// is returned, including HTTP_NOT_MODIFIED, or HTTP_REQUEST_ENTITY_TOO_LARGE when the
+// content is known to be larger than max_size
+// Content past max_size aborts a response in progress, which also returns OK, with *msg set
+//
+DLL_PUBLIC int stream_response(request_rec* r, const char* lcl_path, apr_size_t max_size,
+    const char** msg = nullptr);
 
 // Builds an MLRC uri, suffix optional, returns "/tile</m>/L/R/C" string
 DLL_PUBLIC char* pMLRC(apr_pool_t* pool, const char* prefix, const sloc_t& tile,
@@ -189,12 +301,418 @@ static inline int get_remote_tile(request_rec* r, const char* remote, const sloc
     return get_response(r, pMLRC(r->pool, remote, tile, suffix), dst, psETag);
 }
 
+//
+// Batch tile requests, many tiles in one multipart/mixed response
+// Each part has X-Tile, Status, ETag, Content-Type and Content-Length headers
+// Missing and empty tiles have Content-Location: empty and the empty tile ETag,
+// the empty tile content is only sent with the first one
+//
+
+// Reads the tile list from the tiles query parameter or from a POST body, as comma or space
+// separated L/R/C or M/L/R/C addresses
+// Returns APR_SUCCESS or an HTTP error code
+DLL_PUBLIC int get_tile_list(request_rec* r, std::vector<sloc_t>& tiles, size_t max_tiles = 256);
+
+// Fetches the tiles from source and sends them in order, each part as soon as it is ready
+// Tiles from an http:// source are fetched with get_response by up to concurrency worker
+// threads, otherwise they are fetched one at a time with get_remote_tile. Returns OK
+DLL_PUBLIC int send_tile_batch(request_rec* r, const char* source, const char* suffix,
+    const TiledRaster& raster, const std::vector<sloc_t>& tiles, size_t concurrency = 8);
+
+//
+// ETag index, the last ETag seen by get_response for each path, with a size limit per layer
+// Lets a module answer a conditional request with 304 before fetching anything
+// Entries expire after the TTL, the next fetch of that path refreshes them
+//
+
+// Sets the number of entries per layer and the TTL, drops the index. Zero entries disables it
+// Defaults to 64K entries and 60 seconds
+DLL_PUBLIC void set_etag_index(size_t entries, apr_time_t ttl);
+
+// Records the ETag of path, or removes the entry if ETag is null
+DLL_PUBLIC void etag_index_put(request_rec* r, const char* path, const char* ETag);
+
+// Returns the ETag of path, allocated from r->pool, or nullptr if not known or expired
+DLL_PUBLIC const char* etag_index_get(request_rec* r, const char* path);
+
+// Returns HTTP_NOT_MODIFIED and sets the ETag header if If-None-Match matches the known
+// ETag of path, otherwise DECLINED
+DLL_PUBLIC int etag_index_check(request_rec* r, const char* path);
+
+// Same, for the path get_remote_tile would use
+static inline int etag_index_check_tile(request_rec* r, const char* remote, const sloc_t& tile,
+    const char* suffix)
+{
+    return etag_index_check(r, pMLRC(r->pool, remote, tile, suffix));
+}
+
+//
+// Fetches a tile with get_remote_tile and decodes it into a page of raster.pagebytes()
+// Decoded pages are kept in the page cache, keyed by the tile path and the source ETag,
+// so a tile is decoded again only if it changed. Tiles without an ETag are not cached
+// Returns APR_SUCCESS or an HTTP error code
+// If msg is not null, *msg on return will be the decoding error message
+//
+DLL_PUBLIC int get_decoded_tile(request_rec* r, const char* source, const sloc_t& tile,
+    const char* suffix, const TiledRaster& raster, page_t& page, char** psETag = nullptr,
+    const char** msg = nullptr);
+
+//
+// Transcoding, the output format can be chosen per request
+// The tile is decoded once, the decoded page is shared with get_decoded_tile, and each
+// encoded variant is kept in the page cache, keyed by the source ETag, format and settings
+//
+struct transcode_conf_t {
+    transcode_conf_t() : quality(75), png_level(6), precision(-1) {}
+    int quality; // JPEG
+    int png_level; // PNG compression level
+    double precision; // LERC, negative uses the raster precision
+};
+
+// Output format from the format query parameter, jpeg, png or lerc, or from the Accept header
+// Formats which can't hold the raster data type are ignored, the Accept weights are honored
+// Defaults to raster.format. Sets Vary: Accept when more than one format can be produced
+DLL_PUBLIC ICD::IMG_T negotiate_format(request_rec* r, const TiledRaster& raster);
+
+// Fetches a tile with get_remote_tile and returns it encoded as fmt
+// A tile which is already in that format is returned as it is, with the source ETag
+// Otherwise the ETag is derived from the source ETag, the format and the settings
+// Returns APR_SUCCESS or an HTTP error code
+// If msg is not null, *msg on return will be the codec error message
+DLL_PUBLIC int transcode_tile(request_rec* r, const char* source, const sloc_t& tile,
+    const char* suffix, const TiledRaster& raster, ICD::IMG_T fmt,
+    const transcode_conf_t& conf, ICD::storage_manager& dst, char** psETag,
+    const char** msg = nullptr);
+
+//
+// Builds a tile from the four tiles at the next level, for levels which are not populated
+// The children are fetched with get_decoded_tile, reduced with a reduce_t kernel and the
+// result is encoded in the raster format. Missing children are filled with NoData
+// The encoded tile is cached, keyed by the children ETags, which also generate its ETag
+// Returns APR_SUCCESS, HTTP_NOT_FOUND if none of the children exist, or an HTTP error code
+//
+DLL_PUBLIC int get_overview_tile(request_rec* r, const char* source, const sloc_t& tile,
+    const char* suffix, const TiledRaster& raster, int kernel, ICD::storage_manager& dst,
+    char** psETag = nullptr, const char** msg = nullptr);
+
+//
+// Encodes and sends a decoded page, in the raster format, with the given ETag
+// Pages that are all NoData, zero or fully transparent are sent as the layer empty tile,
+// with the empty tile ETag, so they are shared by caches
+// dst is the buffer for the encoded tile. Handles conditional requests
+//
+DLL_PUBLIC int sendPage(request_rec* r, const TiledRaster& raster, const void* page,
+    ICD::storage_manager& dst, const char* ETag, const char** msg = nullptr);
+
+//
+// Direct HTTP/1.1 client, used by get_response, subr::fetch and range_read for
+// sources given as http:// URLs, instead of a subrequest
+// Connections are kept open per host and reused across requests
+//
+struct http_result_t {
+    http_result_t() : status(0), total(0), overflow(0), length(-1) {}
+    int status; // HTTP status
+    std::string ETag;
+    std::string location;
+    apr_size_t total; // From Content-Range, 0 if not known
+    int overflow; // dst was too small, the body is truncated
+    std::string content_type;
+    std::string last_modified;
+    std::string cache_control;
+    std::string expires;
+    std::string content_encoding;
+    apr_int64_t length; // From Content-Length, -1 if not known
+};
+
+static inline bool is_http_url(const char* url) {
+    return url && !strncmp(url, "http://", 7);
+}
+
+// Issues a GET, headers are additional request headers, for example Range, can be null
+// The body is received in dst, dst.size is set to the received size, unless the status is 304
+// Returns APR_SUCCESS if a response was received, result.status is the HTTP status
+DLL_PUBLIC apr_status_t http_get(const char* url, ICD::storage_manager& dst,
+    http_result_t& result, const apr_table_t* headers = nullptr, const char** msg = nullptr);
+
+// Same, receiving in a chain, which is sized from Content-Length when available
+DLL_PUBLIC apr_status_t http_get(const char* url, receive_chain& dst,
+    http_result_t& result, const apr_table_t* headers = nullptr, const char** msg = nullptr);
+
+// Sets the maximum number of idle connections kept for each host, defaults to 16
+DLL_PUBLIC void set_http_idle_limit(size_t n);
+
 // Issues a range read to URL, based on offset and dst.size
+// http:// URLs are read directly, with http_get
 // Returns the size of the whole file or 0 on error
+// A read which reaches the end of the file is short, the rest of dst is not changed
 // If msg is not null, *msg on return will be a error message string
+// Served from the disk cache when it is enabled, if the source ETag or Last-Modified
+// kept in the cache matches the cached data. Sources without either are not cached
 DLL_PUBLIC apr_size_t range_read(request_rec* r, const char* url, apr_off_t offset,
     ICD::storage_manager& dst, int tries = 4, const char** msg = nullptr);
 
+//
+// Per source circuit breaker, used by subr::fetch, get_response and range_read
+// A source is the host of an http:// URL, otherwise the first component of the path
+// Health is tracked over a ten second window. When the fraction of failed or slow requests
+// reaches the threshold, requests to that source fail right away, for open_time.
+// Then a single probe request decides if the source is used again
+//
+struct breaker_conf_t {
+    breaker_conf_t() : enabled(0), error_rate(0.5), min_requests(20), slow(0),
+        open_time(apr_time_from_sec(5)), max_inflight(0), status(HTTP_SERVICE_UNAVAILABLE) {}
+    int enabled;
+    // Fraction of failed or slow requests which opens the breaker
+    double error_rate;
+    // Requests within the window before the breaker can open
+    apr_uint32_t min_requests;
+    // Requests taking longer count as failed, zero disables
+    apr_time_t slow;
+    apr_time_t open_time;
+    // Concurrent requests to a source, extra ones are shed. Zero means no limit
+    apr_size_t max_inflight;
+    // Returned when failing fast, HTTP_NOT_FOUND makes the tile modules send the empty tile
+    int status;
+};
+
+// Replaces the configuration and drops the tracked state, disabled by default
+DLL_PUBLIC void set_circuit_breaker(const breaker_conf_t& conf);
+
+// Returns 0 if a request to url can be issued, otherwise the status to fail with
+// Every request allowed has to be followed by a breaker_record call
+// When the breaker is half open, probe is set for the one request allowed through, callers
+// which don't pass probe are not let through
+DLL_PUBLIC int breaker_check(request_rec* r, const char* url, int* probe = nullptr);
+
+// Records the outcome of a request, APR_SUCCESS or an HTTP status, and its duration
+// probe is the value set by breaker_check, only the probe closes or reopens the breaker
+// r is only used for local paths, it can be null for http:// URLs
+DLL_PUBLIC void breaker_record(request_rec* r, const char* url, int status, apr_time_t latency,
+    int probe = 0);
+
+// True if the status means the source is failing, as opposed to a valid response
+DLL_PUBLIC int source_failed(int status);
+
+//
+// Replicated sources, a source given as a comma separated list of equivalent paths or URLs
+// The first one is the primary, used to build request URLs. subr::fetch, get_response and
+// range_read send a request under the primary to the replicas, fastest first, and move to
+// the next one when a request fails
+//
+
+// Registers the list, returns the primary in *primary
+// Returns nullptr on success, otherwise an error message
+DLL_PUBLIC const char* set_replicas(apr_pool_t* p, const char* sources, const char** primary);
+
+// The equivalent URLs, fastest first, or just url when it is not under a replicated source
+DLL_PUBLIC std::vector<std::string> replica_urls(const char* url);
+
+// Updates the latency average of the replica that url belongs to
+DLL_PUBLIC void replica_record(const char* url, bool failed, apr_time_t latency);
+
+// Hedged range reads from http:// replicas, when a request takes longer than this
+// percentile of the recent latencies, the next replica is also read. Zero, the default, disables
+DLL_PUBLIC void set_replica_hedging(double percentile);
+
+// Range read from the first replica that answers, with hedging
+// Returns APR_SUCCESS with the file size in *total, an HTTP error, or DECLINED when
+// hedging is off. The source ETag or Last-Modified is returned in validator, if not null
+// A range past the end of the file returns HTTP_RANGE_NOT_SATISFIABLE
+// Replicas with an open circuit breaker are skipped, when all are, returns the breaker status
+DLL_PUBLIC int hedged_range_read(request_rec* r, const std::vector<std::string>& urls,
+    apr_off_t offset, ICD::storage_manager& dst, apr_size_t* total,
+    std::string* validator = nullptr);
+
+//
+// Persistent cache of remote reads on local disk, shared by all processes
+// Used by range_read and by subr::fetch for range requests, before issuing the request
+// An entry is keyed by URL, offset, size and a validator, usually the source ETag
+// The oldest entries are dropped to stay within the budget
+// The last validator of each source URL is kept in the cache too, so it is known after
+// a restart. Once older than the validator TTL, it is confirmed with a conditional request
+//
+
+// Enables the cache in the path folder, created if needed. A zero budget disables it
+// An existing cache with the same budget is reused
+// validator_ttl is the time a validator is used without asking the source, negative for
+// the default of 5 minutes
+// Returns nullptr on success, otherwise an error message
+DLL_PUBLIC const char* set_disk_cache(apr_pool_t* p, const char* path, apr_uint64_t budget,
+    apr_interval_time_t validator_ttl = -1);
+
+// Reads dst.size bytes from the cache, returns APR_SUCCESS or APR_NOTFOUND
+// The tag and total stored with the data are returned when the pointers are not null
+DLL_PUBLIC apr_status_t disk_cache_get(const char* url, apr_off_t offset,
+    const char* validator, ICD::storage_manager& dst, std::string* tag = nullptr,
+    apr_uint64_t* total = nullptr);
+
+// Stores src, tag and total are optional values returned by disk_cache_get
+DLL_PUBLIC void disk_cache_put(const char* url, apr_off_t offset, const char* validator,
+    const ICD::storage_manager& src, const char* tag = nullptr, apr_uint64_t total = 0);
+
+// Last validator stored for url, returns APR_SUCCESS or APR_NOTFOUND
+// stale is set when the validator is older than the validator TTL
+DLL_PUBLIC apr_status_t disk_cache_get_validator(const char* url, std::string& validator,
+    bool* stale = nullptr);
+
+// Stores the validator for url, as confirmed now
+DLL_PUBLIC void disk_cache_put_validator(const char* url, const char* validator);
+
+//
+// Hot tiles, the most requested tile paths of each layer, counted by getMLRC
+// The hot set is saved to a file every period by a background thread, which also halves the
+// counts. A warmer thread requests the saved hot set from the server itself at a limited
+// rate, filling the caches after a restart. Up to 64 layers are tracked
+//
+struct hot_tiles_conf_t {
+    hot_tiles_conf_t() : path(nullptr), size(1024), period(apr_time_from_sec(300)),
+        warm_url(nullptr), rate(10) {}
+    // Hot set file, null disables the tracking
+    const char* path;
+    // Tiles kept per layer
+    apr_size_t size;
+    apr_time_t period;
+    // http:// URL of this server, the tile paths are appended to it. Null disables the warm up
+    const char* warm_url;
+    // Warm up requests per second
+    double rate;
+};
+
+// Replaces the configuration and drops the counts, disabled by default
+// The hot set is also saved when p is cleaned up
+// Returns nullptr on success, otherwise an error message
+DLL_PUBLIC const char* set_hot_tiles(apr_pool_t* p, const hot_tiles_conf_t& conf);
+
+// Starts the save and the warm up threads, call from the child init hook
+// Otherwise they start on the first counted request
+DLL_PUBLIC void hot_tiles_start();
+
+// Counts a client request for a tile, subrequests and warm up requests are not counted
+DLL_PUBLIC void hot_tile_record(request_rec* r);
+
+// Saves the hot set, replacing the file
+DLL_PUBLIC apr_status_t hot_tiles_save();
+
+//
+// Tile buffers, reused across requests
+// Returns a buffer of at least size bytes, taken from a per thread cache when possible
+// The buffer is returned to the cache when the pool p is cleared or destroyed
+// Use for large buffers, such as MaxTileSize ones, instead of apr_palloc
+// Returns nullptr if the allocation fails
+//
+DLL_PUBLIC void* get_tile_buffer(apr_pool_t* p, apr_size_t size);
+
+// Returns a buffer obtained from get_tile_buffer to the cache, before the pool cleanup
+DLL_PUBLIC void release_tile_buffer(apr_pool_t* p, void* buffer);
+
+// Sets the maximum total size of the idle cached buffers, across all threads
+// Defaults to 256MB
+DLL_PUBLIC void set_tile_buffer_cap(apr_size_t bytes);
+
+//
+// MRF index reader, maps a tile to the data file range
+// A local index file is memory mapped, otherwise the index name is used as a
+// redirect path and the index is read in blocks with range_read, which are cached
+//
+struct index_reader_t;
+
+// Opens an index for the raster, the reader is valid for the lifetime of the pool
+// Returns nullptr on success, otherwise an error message
+DLL_PUBLIC const char* open_index(apr_pool_t* p, const char* fname,
+    const TiledRaster& raster, index_reader_t** pidx);
+
+// Reads the index entry for a tile, in host order. The tile level is the external one
+// A zero size entry means the tile doesn't exist, which is also the case for a short index
+// The request is only used for remote indices
+// Returns APR_SUCCESS or an HTTP error code, HTTP_BAD_REQUEST if the tile is out of bounds
+// If msg is not null, *msg on return will be a error message string
+DLL_PUBLIC int read_index(request_rec* r, index_reader_t* idx, const sloc_t& tile,
+    range_t& entry, const char** msg = nullptr);
+
+// Reads the index entries for n tiles, stops at the first error
+DLL_PUBLIC int read_index_batch(request_rec* r, index_reader_t* idx, const sloc_t* tiles,
+    size_t n, range_t* entries, const char** msg = nullptr);
+
+//
+// Tile existence bitmap, one bit per index record, for answering missing tiles
+// and tiles outside of the raster without reading the index or the data
+// Built from a local index, optionally saved to a file, which can be mapped at startup
+//
+struct tile_bitmap_t;
+
+// Builds the bitmap from a local index, which has to be complete
+// Also writes it to bitmap_fname if not null
+// The bitmap is valid for the lifetime of the pool. Returns nullptr or an error message
+DLL_PUBLIC const char* build_tile_bitmap(apr_pool_t* p, const char* index_fname,
+    const TiledRaster& raster, tile_bitmap_t** pbm, const char* bitmap_fname = nullptr);
+
+// Maps a bitmap file written by build_tile_bitmap, checking that it matches the raster
+DLL_PUBLIC const char* open_tile_bitmap(apr_pool_t* p, const char* fname,
+    const TiledRaster& raster, tile_bitmap_t** pbm);
+
+// Returns 1 if the tile exists, 0 if it doesn't and -1 if it is outside of the raster
+// The tile level is the external one
+DLL_PUBLIC int tile_exists(const tile_bitmap_t* bm, const sloc_t& tile);
+
+// Attaches a bitmap to an index reader, read_index then returns missing tiles without reading
+// The index has to have one record for every tile in the bitmap, a remote index has to be
+// read before, so its size is known. Returns nullptr or an error message, when not attached
+DLL_PUBLIC const char* set_index_bitmap(index_reader_t* idx, const tile_bitmap_t* bm);
+
+//
+// Process wide cache of open read only local files
+// Files are reference counted, closed when evicted and no longer in use
+// Cached files are checked periodically, a file which changed is reopened
+//
+struct cached_file_t;
+
+// Returns a cached file handle, which has to be released after use
+// Returns nullptr if the file can't be opened, the reason is in *pstat if pstat is not null
+DLL_PUBLIC cached_file_t* acquire_file(const char* path, apr_status_t* pstat = nullptr);
+
+DLL_PUBLIC void release_file(cached_file_t* cf);
+
+// Reads up to size bytes at offset, returns the number of bytes read
+DLL_PUBLIC apr_size_t cached_pread(cached_file_t* cf, apr_off_t offset, void* buffer,
+    apr_size_t size);
+
+// File size when it was opened
+DLL_PUBLIC apr_off_t cached_file_size(const cached_file_t* cf);
+
+// Sets the maximum number of files kept open, defaults to 256
+// Files in use are not closed, so the limit can be exceeded temporarily
+DLL_PUBLIC void set_file_cache_limit(size_t max_open);
+
+//
+// Reads dst.size bytes at offset from a virtual file
+// A local file is read directly, with a positional read. Otherwise the name is used as a
+// redirect path and the data is read with range_read
+// The offset is absolute, the read has to fit within the vfile range if the range size is set
+// Returns APR_SUCCESS or an HTTP error code
+// If msg is not null, *msg on return will be a error message string
+//
+DLL_PUBLIC int vfile_pread(request_rec* r, const vfile_t& vf, apr_off_t offset,
+    ICD::storage_manager& dst, const char** msg = nullptr);
+
+// A read from a cached file, for batch_pread
+struct read_req_t {
+    cached_file_t* file;
+    apr_off_t offset;
+    apr_size_t size;
+    void* buffer;
+    apr_size_t nread; // output
+};
+
+// Issues all reads at once, using io_uring on linux when available, and waits for all
+// of them to complete. Falls back to sequential reads
+// A request is complete when nread == size
+DLL_PUBLIC void batch_pread(read_req_t* reqs, size_t n);
+
+// Like vfile_pread, for n reads from the same file
+// Local reads are issued with batch_pread, stops at the first error
+DLL_PUBLIC int vfile_pread_batch(request_rec* r, const vfile_t& vf, const apr_off_t* offsets,
+    ICD::storage_manager* dsts, size_t n, const char** msg = nullptr);
+
 //  TEMPLATES
 
 // Fetch the request configuration if it exists, otherwise the per_directory one
@@ -213,6 +731,12 @@ template<typename T> void* pcreate(apr_pool_t* p, char* /* path */) {
 template<typename T> const char* set_source(cmd_parms* cmd, T* cfg,
     const char* src, const char* suffix)
 {
+    // A list of replicas
+    if (strchr(src, ',')) {
+        const char* err = set_replicas(cmd->pool, src, &src);
+        if (err)
+            return err;
+    }
     cfg->source = apr_pstrdup(cmd->pool, src);
     if (suffix && suffix[0])
         cfg->suffix = apr_pstrdup(cmd->pool, suffix);
@@ -0,0 +1,361 @@
+/*
+* ahtse_index.cpp
+*
+* MRF index reader and tile existence bitmap
+*
+* The MRF index is an array of 16 byte records, offset and size of each tile,
+* both 64bit big endian. Levels start at the rset tile offset, full resolution first
+* The bitmap has one bit per index record, set if the tile exists
+*
+* (C) Lucian Plesea 2019-2021
+*
+*/
+
+#include "ahtse.h"
+#include <apr_mmap.h>
+#include <new>
+#include <mutex>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+using namespace std;
+NS_ICD_USE
+
+NS_AHTSE_START
+
+// Remote index blocks, 2048 entries each
+#define IDX_BLOCK_SIZE (32 * 1024)
+// Maximum number of cached blocks per remote index, 16MB
+#define IDX_MAX_BLOCKS 512
+
+struct index_reader_t {
+    const TiledRaster* raster;
+    const char* fname;
+
+    // Local index, mapped, might be shorter than the full index
+    const char* map;
+    apr_uint64_t map_size;
+
+    // Remote index, LRU cache of blocks, most recent in front
+    // File size is discovered on the first read, zero until then
+    apr_uint64_t fsize;
+    mutex lock;
+    list<pair<apr_uint64_t, vector<char>>> blocks;
+    unordered_map<apr_uint64_t, decltype(blocks)::iterator> block_map;
+
+    // Optional, missing tiles are answered without reading the index
+    const tile_bitmap_t* bitmap;
+};
+
+// Maps size bytes of a local file, read only, for the lifetime of the pool
+static const char* map_file(apr_pool_t* p, const char* fname, apr_uint64_t size,
+    const char** map)
+{
+    apr_file_t* f;
+    apr_status_t stat = apr_file_open(&f, fname, READ_RIGHTS, 0, p);
+    if (APR_SUCCESS != stat)
+        return apr_psprintf(p, "Can't open %s, %pm", fname, &stat);
+
+    apr_mmap_t* mm;
+    stat = apr_mmap_create(&mm, f, 0, static_cast<apr_size_t>(size), APR_MMAP_READ, p);
+    apr_file_close(f);
+    if (APR_SUCCESS != stat)
+        return apr_psprintf(p, "Can't map %s, %pm", fname, &stat);
+
+    *map = static_cast<const char*>(mm->mm);
+    return nullptr;
+}
+
+static apr_status_t index_reader_cleanup(void* data) {
+    static_cast<index_reader_t*>(data)->~index_reader_t();
+    return APR_SUCCESS;
+}
+
+const char* open_index(apr_pool_t* p, const char* fname, const TiledRaster& raster,
+    index_reader_t** pidx)
+{
+    auto idx = new (apr_pcalloc(p, sizeof(index_reader_t))) index_reader_t;
+    apr_pool_cleanup_register(p, idx, index_reader_cleanup, apr_pool_cleanup_null);
+    idx->raster = &raster;
+    idx->fname = apr_pstrdup(p, fname);
+    idx->map = nullptr;
+    idx->map_size = 0;
+    idx->fsize = 0;
+    idx->bitmap = nullptr;
+    *pidx = idx;
+
+    // Not a local file, assume it is remote
+    apr_finfo_t finfo;
+    if (APR_SUCCESS != apr_stat(&finfo, fname, APR_FINFO_SIZE | APR_FINFO_TYPE, p)
+        || APR_REG != finfo.filetype)
+        return nullptr;
+
+    // Local empty index, all tiles are missing
+    idx->map = "";
+    if (0 == finfo.size)
+        return nullptr;
+
+    const char* msg = map_file(p, fname, finfo.size, &idx->map);
+    if (!msg)
+        idx->map_size = finfo.size;
+    return msg;
+}
+
+// Decode a raw index record
+static void to_entry(const char* rec, range_t& entry) {
+    uint64_t v[2];
+    memcpy(v, rec, sizeof(v));
+    entry.offset = ntoh64(v[0]);
+    entry.size = ntoh64(v[1]);
+}
+
+// Index file offset of a tile, returns false if out of bounds
+static bool tile_offset(const TiledRaster& raster, const sloc_t& tile, apr_uint64_t& off) {
+    size_t level = static_cast<size_t>(tile.l) + raster.skip;
+    if (level >= raster.n_levels || tile.z >= raster.size.z)
+        return false;
+    const rset& rs = raster.rsets[level];
+    if (tile.x >= rs.w || tile.y >= rs.h)
+        return false;
+    off = 16 * (rs.tiles + (tile.z * rs.h + tile.y) * rs.w + tile.x);
+    return true;
+}
+
+// Copy one remote record from a cached block, fetch the block if not cached
+static int read_remote(request_rec* r, index_reader_t* idx, apr_uint64_t off,
+    range_t& entry, const char** msg)
+{
+    apr_uint64_t bnum = off / IDX_BLOCK_SIZE;
+    apr_uint64_t boff = off % IDX_BLOCK_SIZE;
+    apr_uint64_t known_size;
+    {
+        lock_guard<mutex> guard(idx->lock);
+        known_size = idx->fsize;
+        if (idx->fsize && off + 16 > idx->fsize) { // Past the end
+            entry.offset = entry.size = 0;
+            return APR_SUCCESS;
+        }
+        auto it = idx->block_map.find(bnum);
+        if (it != idx->block_map.end()) {
+            idx->blocks.splice(idx->blocks.begin(), idx->blocks, it->second);
+            to_entry(it->second->second.data() + boff, entry);
+            return APR_SUCCESS;
+        }
+    }
+
+    // Read the block without holding the lock, clipped to the file size if known
+    // A block which reaches past the end of the index comes back short, the rest is zero
+    apr_uint64_t bsize = IDX_BLOCK_SIZE;
+    if (known_size && bnum * IDX_BLOCK_SIZE + bsize > known_size)
+        bsize = known_size - bnum * IDX_BLOCK_SIZE;
+    vector<char> block(static_cast<size_t>(bsize));
+    storage_manager dst(block.data(), block.size());
+    const char* message = nullptr;
+    apr_size_t fsize = range_read(r, idx->fname, bnum * IDX_BLOCK_SIZE, dst, 4, &message);
+    if (0 == fsize) {
+        int status = HTTP_NOT_FOUND;
+        if (message)
+            sscanf(message, "Remote responds with %d", &status);
+        // The index ends before this block, a short index means missing tiles
+        if (HTTP_RANGE_NOT_SATISFIABLE == status) {
+            entry.offset = entry.size = 0;
+            return APR_SUCCESS;
+        }
+        if (msg)
+            *msg = message;
+        return HTTP_NOT_FOUND;
+    }
+
+    if (off + 16 > fsize)
+        entry.offset = entry.size = 0;
+    else
+        to_entry(block.data() + boff, entry);
+    lock_guard<mutex> guard(idx->lock);
+    idx->fsize = fsize;
+    if (idx->block_map.count(bnum)) // Another thread got it first
+        return APR_SUCCESS;
+    if (idx->blocks.size() >= IDX_MAX_BLOCKS) {
+        idx->block_map.erase(idx->blocks.back().first);
+        idx->blocks.pop_back();
+    }
+    idx->blocks.emplace_front(bnum, move(block));
+    idx->block_map[bnum] = idx->blocks.begin();
+    return APR_SUCCESS;
+}
+
+int read_index(request_rec* r, index_reader_t* idx, const sloc_t& tile, range_t& entry,
+    const char** msg)
+{
+    apr_uint64_t off;
+    if (!tile_offset(*idx->raster, tile, off)) {
+        if (msg)
+            *msg = "Tile out of bounds";
+        return HTTP_BAD_REQUEST;
+    }
+
+    if (idx->bitmap && 0 == tile_exists(idx->bitmap, tile)) {
+        entry.offset = entry.size = 0;
+        return APR_SUCCESS;
+    }
+
+    if (!idx->map)
+        return read_remote(r, idx, off, entry, msg);
+
+    // Local, a short index means missing tiles
+    if (off + 16 > idx->map_size)
+        entry.offset = entry.size = 0;
+    else
+        to_entry(idx->map + off, entry);
+    return APR_SUCCESS;
+}
+
+int read_index_batch(request_rec* r, index_reader_t* idx, const sloc_t* tiles, size_t n,
+    range_t* entries, const char** msg)
+{
+    // Remote blocks are cached, so nearby tiles cost a single read
+    for (size_t i = 0; i < n; i++) {
+        int status = read_index(r, idx, tiles[i], entries[i], msg);
+        if (APR_SUCCESS != status)
+            return status;
+    }
+    return APR_SUCCESS;
+}
+
+//
+// Tile existence bitmap
+// The file has a 16 byte header, the signature and the number of bits as a big endian
+// 64bit integer, followed by the bits. Bit i is (1 << (i % 8)) in byte i / 8
+//
+
+#define TBM_SIG "AHTSETBM"
+#define TBM_HEADER 16
+
+struct tile_bitmap_t {
+    const TiledRaster* raster;
+    const unsigned char* bits;
+    apr_uint64_t nbits;
+};
+
+// Number of records in the full index of the raster
+static apr_uint64_t index_records(const TiledRaster& raster) {
+    if (0 == raster.n_levels)
+        return 0;
+    // Level 0 is the last one in the index
+    const rset& last = raster.rsets[0];
+    return last.tiles + static_cast<apr_uint64_t>(raster.size.z) * last.w * last.h;
+}
+
+const char* build_tile_bitmap(apr_pool_t* p, const char* index_fname,
+    const TiledRaster& raster, tile_bitmap_t** pbm, const char* bitmap_fname)
+{
+    apr_finfo_t finfo;
+    apr_status_t stat = apr_stat(&finfo, index_fname, APR_FINFO_SIZE, p);
+    if (APR_SUCCESS != stat)
+        return apr_psprintf(p, "Can't stat index file %s, %pm", index_fname, &stat);
+
+    auto bm = static_cast<tile_bitmap_t*>(apr_pcalloc(p, sizeof(tile_bitmap_t)));
+    bm->raster = &raster;
+    bm->nbits = index_records(raster);
+    if (static_cast<apr_uint64_t>(finfo.size) != bm->nbits * 16)
+        return apr_psprintf(p, "Index file %s size doesn't match the raster", index_fname);
+    apr_size_t nbytes = static_cast<apr_size_t>((bm->nbits + 7) / 8);
+    auto data = static_cast<unsigned char*>(apr_pcalloc(p, TBM_HEADER + nbytes));
+    memcpy(data, TBM_SIG, 8);
+    uint64_t n = hton64(bm->nbits);
+    memcpy(data + 8, &n, 8);
+    unsigned char* bits = data + TBM_HEADER;
+    bm->bits = bits;
+
+    apr_uint64_t records = bm->nbits;
+    if (records) {
+        const char* map;
+        const char* msg = map_file(p, index_fname, records * 16, &map);
+        if (msg)
+            return msg;
+        for (apr_uint64_t i = 0; i < records; i++) {
+            range_t entry;
+            to_entry(map + i * 16, entry);
+            if (entry.size)
+                bits[i / 8] |= static_cast<unsigned char>(1 << (i % 8));
+        }
+    }
+
+    if (bitmap_fname) {
+        // Write to a temporary file, then rename, so readers never see a partial file
+        const char* tname = apr_pstrcat(p, bitmap_fname, ".tmp", NULL);
+        apr_file_t* f;
+        stat = apr_file_open(&f, tname,
+            APR_FOPEN_WRITE | APR_FOPEN_CREATE | APR_FOPEN_TRUNCATE | APR_FOPEN_BINARY,
+            APR_OS_DEFAULT, p);
+        if (APR_SUCCESS != stat)
+            return apr_psprintf(p, "Can't create %s, %pm", tname, &stat);
+        apr_size_t written;
+        stat = apr_file_write_full(f, data, TBM_HEADER + nbytes, &written);
+        apr_file_close(f);
+        if (APR_SUCCESS == stat)
+            stat = apr_file_rename(tname, bitmap_fname, p);
+        if (APR_SUCCESS != stat)
+            return apr_psprintf(p, "Can't write %s, %pm", bitmap_fname, &stat);
+    }
+
+    *pbm = bm;
+    return nullptr;
+}
+
+const char* open_tile_bitmap(apr_pool_t* p, const char* fname, const TiledRaster& raster,
+    tile_bitmap_t** pbm)
+{
+    apr_finfo_t finfo;
+    apr_status_t stat = apr_stat(&finfo, fname, APR_FINFO_SIZE, p);
+    if (APR_SUCCESS != stat)
+        return apr_psprintf(p, "Can't stat tile bitmap %s, %pm", fname, &stat);
+
+    auto bm = static_cast<tile_bitmap_t*>(apr_pcalloc(p, sizeof(tile_bitmap_t)));
+    bm->raster = &raster;
+    bm->nbits = index_records(raster);
+    apr_uint64_t expected = TBM_HEADER + (bm->nbits + 7) / 8;
+    if (static_cast<apr_uint64_t>(finfo.size) != expected)
+        return apr_psprintf(p, "Tile bitmap %s size doesn't match the raster", fname);
+
+    const char* map;
+    const char* msg = map_file(p, fname, expected, &map);
+    if (msg)
+        return msg;
+
+    uint64_t n;
+    memcpy(&n, map + 8, 8);
+    if (memcmp(map, TBM_SIG, 8) || ntoh64(n) != bm->nbits)
+        return apr_psprintf(p, "Tile bitmap %s is not valid for this raster", fname);
+
+    bm->bits = reinterpret_cast<const unsigned char*>(map) + TBM_HEADER;
+    *pbm = bm;
+    return nullptr;
+}
+
+const char* set_index_bitmap(index_reader_t* idx, const tile_bitmap_t* bm) {
+    apr_uint64_t size;
+    {
+        lock_guard<mutex> guard(idx->lock);
+        size = idx->map ? idx->map_size : idx->fsize;
+    }
+    if (0 == size)
+        return "Index size not known";
+    if (size != bm->nbits * 16)
+        return "Index size doesn't match the tile bitmap";
+    idx->bitmap = bm;
+    return nullptr;
+}
+
+int tile_exists(const tile_bitmap_t* bm, const sloc_t& tile) {
+    apr_uint64_t off;
+    if (!tile_offset(*bm->raster, tile, off))
+        return -1;
+    apr_uint64_t i = off / 16;
+    if (i >= bm->nbits)
+        return 0;
+    return (bm->bits[i / 8] >> (i % 8)) & 1;
+}
+
+NS_AHTSE_END
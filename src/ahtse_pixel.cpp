@@ -0,0 +1,784 @@
+/*
+* ahtse_pixel.cpp
+*
+* Pixel kernels, on pages described by a TiledRaster
+*
+* Each kernel is a template, instantiated for every ICD data type. The hot cases have
+* SSE4.1 and AVX2 versions, picked at runtime based on the CPU. The 2x2 reduction only
+* needs SSE2, so it has a single SIMD version. The scalar templates are
+* used everywhere else, and on compilers other than GCC and clang
+* The SIMD versions produce exactly the same values as the scalar ones, test/pixel_test.cpp
+* checks this and measures both
+*
+* (C) Lucian Plesea 2019-2021
+*
+*/
+
+#include "ahtse_common.h"
+#include <cmath>
+#include <limits>
+#include <type_traits>
+#include <algorithm>
+#include <atomic>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+using namespace std;
+NS_ICD_USE
+
+NS_AHTSE_START
+
+// Calls F<T>(args) for the data type dt
+#define DT_DISPATCH(dt, F, ...) switch (dt) {\
+    case ICDT_Byte: F<uint8_t>(__VA_ARGS__); break;\
+    case ICDT_UInt16: F<uint16_t>(__VA_ARGS__); break;\
+    case ICDT_Int16: F<int16_t>(__VA_ARGS__); break;\
+    case ICDT_UInt32: F<uint32_t>(__VA_ARGS__); break;\
+    case ICDT_Int32: F<int32_t>(__VA_ARGS__); break;\
+    case ICDT_Float32: F<float>(__VA_ARGS__); break;\
+    case ICDT_Float64: F<double>(__VA_ARGS__); break;\
+    default: break;\
+}
+
+// 0 is scalar, 1 is SSE4.1, 2 is AVX2
+enum simd_level_t { SIMD_NONE = 0, SIMD_SSE41, SIMD_AVX2 };
+
+static simd_level_t detect_simd() {
+#if defined(HAVE_X86_SIMD)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return SIMD_SSE41;
+#endif
+    return SIMD_NONE;
+}
+
+static atomic<int> simd_limit(SIMD_AVX2);
+
+void set_simd_limit(int level) {
+    simd_limit = level;
+}
+
+static simd_level_t simd_level() {
+    static const simd_level_t level = detect_simd();
+    return static_cast<simd_level_t>(min<int>(level, simd_limit));
+}
+
+#if defined(HAVE_X86_SIMD)
+
+// Rounds 8 values the same way saturate does, to [0, top], as 8 uint16 values
+// Done in double, like the scalar code, so the results are identical
+TARGET_AVX2 static inline __m128i round_pack_avx2(__m256d lo, __m256d hi, __m256d top) {
+    const __m256d half = _mm256_set1_pd(0.5);
+    const __m256d zero = _mm256_setzero_pd();
+    // max returns the second argument for NaN, which becomes zero
+    lo = _mm256_min_pd(_mm256_max_pd(_mm256_floor_pd(_mm256_add_pd(lo, half)), zero), top);
+    hi = _mm256_min_pd(_mm256_max_pd(_mm256_floor_pd(_mm256_add_pd(hi, half)), zero), top);
+    return _mm_packus_epi32(_mm256_cvttpd_epi32(lo), _mm256_cvttpd_epi32(hi));
+}
+
+// Same, for 8 values in four pairs
+TARGET_SSE41 static inline __m128i round_pack_sse41(const __m128d* v, __m128d top) {
+    const __m128d half = _mm_set1_pd(0.5);
+    const __m128d zero = _mm_setzero_pd();
+    __m128i w[4];
+    for (int i = 0; i < 4; i++)
+        w[i] = _mm_cvttpd_epi32(_mm_min_pd(_mm_max_pd(_mm_floor_pd(_mm_add_pd(v[i], half)),
+            zero), top));
+    return _mm_packus_epi32(_mm_unpacklo_epi64(w[0], w[1]), _mm_unpacklo_epi64(w[2], w[3]));
+}
+
+// Four Float32 values from v, as two pairs of doubles
+TARGET_SSE41 static inline void to_pd_sse41(__m128 v, __m128d* d) {
+    d[0] = _mm_cvtps_pd(v);
+    d[1] = _mm_cvtps_pd(_mm_movehl_ps(v, v));
+}
+
+#endif
+
+static size_t page_values(const TiledRaster& raster) {
+    return raster.pagesize.x * raster.pagesize.y * raster.pagesize.c;
+}
+
+// Convert a double to T, rounding and saturating for integer types
+template<typename T> static inline T saturate(double v) {
+    if (!is_integral<T>::value)
+        return static_cast<T>(v);
+    if (v != v) // NaN
+        return 0;
+    if (v <= static_cast<double>(numeric_limits<T>::lowest()))
+        return numeric_limits<T>::lowest();
+    if (v >= static_cast<double>(numeric_limits<T>::max()))
+        return numeric_limits<T>::max();
+    return static_cast<T>(floor(v + 0.5));
+}
+
+//
+// Data type conversion
+//
+
+template<typename S, typename D> static void convert_t(const S* src, D* dst, size_t count) {
+    for (size_t i = 0; i < count; i++)
+        dst[i] = saturate<D>(static_cast<double>(src[i]));
+}
+
+template<typename S> static void convert_from(const void* src, void* dst, ICDDataType ddt,
+    size_t count)
+{
+    const S* s = static_cast<const S*>(src);
+    switch (ddt) {
+    case ICDT_Byte: convert_t(s, static_cast<uint8_t*>(dst), count); break;
+    case ICDT_UInt16: convert_t(s, static_cast<uint16_t*>(dst), count); break;
+    case ICDT_Int16: convert_t(s, static_cast<int16_t*>(dst), count); break;
+    case ICDT_UInt32: convert_t(s, static_cast<uint32_t*>(dst), count); break;
+    case ICDT_Int32: convert_t(s, static_cast<int32_t*>(dst), count); break;
+    case ICDT_Float32: convert_t(s, static_cast<float*>(dst), count); break;
+    case ICDT_Float64: convert_t(s, static_cast<double*>(dst), count); break;
+    default: break;
+    }
+}
+
+#if defined(HAVE_X86_SIMD)
+
+// Integer to Float32 is exact
+TARGET_AVX2 static size_t convert_to_float_avx2(const void* src, ICDDataType sdt, float* dst,
+    size_t count)
+{
+    size_t i = 0;
+    switch (sdt) {
+    case ICDT_Byte:
+        for (const uint8_t* s = static_cast<const uint8_t*>(src); i + 8 <= count; i += 8)
+            _mm256_storeu_ps(dst + i, _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+                _mm_loadl_epi64(reinterpret_cast<const __m128i*>(s + i)))));
+        break;
+    case ICDT_UInt16:
+        for (const uint16_t* s = static_cast<const uint16_t*>(src); i + 8 <= count; i += 8)
+            _mm256_storeu_ps(dst + i, _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i)))));
+        break;
+    case ICDT_Int16:
+        for (const int16_t* s = static_cast<const int16_t*>(src); i + 8 <= count; i += 8)
+            _mm256_storeu_ps(dst + i, _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i)))));
+        break;
+    default:
+        break;
+    }
+    return i;
+}
+
+TARGET_SSE41 static size_t convert_to_float_sse41(const void* src, ICDDataType sdt, float* dst,
+    size_t count)
+{
+    size_t i = 0;
+    switch (sdt) {
+    case ICDT_Byte:
+        for (const uint8_t* s = static_cast<const uint8_t*>(src); i + 4 <= count; i += 4) {
+            int32_t v;
+            memcpy(&v, s + i, sizeof(v));
+            _mm_storeu_ps(dst + i, _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(v))));
+        }
+        break;
+    case ICDT_UInt16:
+        for (const uint16_t* s = static_cast<const uint16_t*>(src); i + 4 <= count; i += 4)
+            _mm_storeu_ps(dst + i, _mm_cvtepi32_ps(_mm_cvtepu16_epi32(
+                _mm_loadl_epi64(reinterpret_cast<const __m128i*>(s + i)))));
+        break;
+    case ICDT_Int16:
+        for (const int16_t* s = static_cast<const int16_t*>(src); i + 4 <= count; i += 4)
+            _mm_storeu_ps(dst + i, _mm_cvtepi32_ps(_mm_cvtepi16_epi32(
+                _mm_loadl_epi64(reinterpret_cast<const __m128i*>(s + i)))));
+        break;
+    default:
+        break;
+    }
+    return i;
+}
+
+// Float32 to Byte or UInt16
+TARGET_AVX2 static size_t convert_from_float_avx2(const float* src, void* dst,
+    ICDDataType ddt, size_t count)
+{
+    size_t i = 0;
+    if (ICDT_Byte != ddt && ICDT_UInt16 != ddt)
+        return i;
+    const __m256d top = _mm256_set1_pd(ICDT_Byte == ddt ? 255.0 : 65535.0);
+    for (; i + 8 <= count; i += 8) {
+        __m256 v = _mm256_loadu_ps(src + i);
+        __m128i w = round_pack_avx2(_mm256_cvtps_pd(_mm256_castps256_ps128(v)),
+            _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)), top);
+        if (ICDT_Byte == ddt)
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(static_cast<uint8_t*>(dst) + i),
+                _mm_packus_epi16(w, w));
+        else
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(static_cast<uint16_t*>(dst) + i), w);
+    }
+    return i;
+}
+
+TARGET_SSE41 static size_t convert_from_float_sse41(const float* src, void* dst,
+    ICDDataType ddt, size_t count)
+{
+    size_t i = 0;
+    if (ICDT_Byte != ddt && ICDT_UInt16 != ddt)
+        return i;
+    const __m128d top = _mm_set1_pd(ICDT_Byte == ddt ? 255.0 : 65535.0);
+    __m128d d[4];
+    for (; i + 8 <= count; i += 8) {
+        to_pd_sse41(_mm_loadu_ps(src + i), d);
+        to_pd_sse41(_mm_loadu_ps(src + i + 4), d + 2);
+        __m128i w = round_pack_sse41(d, top);
+        if (ICDT_Byte == ddt)
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(static_cast<uint8_t*>(dst) + i),
+                _mm_packus_epi16(w, w));
+        else
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(static_cast<uint16_t*>(dst) + i), w);
+    }
+    return i;
+}
+
+#endif
+
+void convert_values(const void* src, ICDDataType sdt, void* dst, ICDDataType ddt,
+    size_t count)
+{
+    if (sdt == ddt) {
+        memmove(dst, src, count * getTypeSize(sdt));
+        return;
+    }
+
+#if defined(HAVE_X86_SIMD)
+    // The SIMD code does the whole vectors, the rest is done below
+    simd_level_t level = simd_level();
+    if (SIMD_NONE != level) {
+        size_t done = 0;
+        if (ICDT_Float32 == ddt)
+            done = (SIMD_AVX2 == level)
+                ? convert_to_float_avx2(src, sdt, static_cast<float*>(dst), count)
+                : convert_to_float_sse41(src, sdt, static_cast<float*>(dst), count);
+        else if (ICDT_Float32 == sdt)
+            done = (SIMD_AVX2 == level)
+                ? convert_from_float_avx2(static_cast<const float*>(src), dst, ddt, count)
+                : convert_from_float_sse41(static_cast<const float*>(src), dst, ddt, count);
+        src = static_cast<const uint8_t*>(src) + done * getTypeSize(sdt);
+        dst = static_cast<uint8_t*>(dst) + done * getTypeSize(ddt);
+        count -= done;
+    }
+#endif
+
+    DT_DISPATCH(sdt, convert_from, src, dst, ddt, count);
+}
+
+//
+// NoData mask, 0 for NoData, 255 otherwise
+//
+
+template<typename T> static void ndv_mask_t(const void* src, uint8_t* mask, size_t count,
+    double ndv, size_t* nodata)
+{
+    const T* s = static_cast<const T*>(src);
+    size_t n = 0;
+    // NaN NoData only makes sense for floating point
+    if (ndv != ndv) {
+        for (size_t i = 0; i < count; i++) {
+            mask[i] = (s[i] != s[i]) ? 0 : 255;
+            n += (s[i] != s[i]);
+        }
+    }
+    else {
+        T v = saturate<T>(ndv);
+        for (size_t i = 0; i < count; i++) {
+            mask[i] = (s[i] == v) ? 0 : 255;
+            n += (s[i] == v);
+        }
+    }
+    *nodata = n;
+}
+
+#if defined(HAVE_X86_SIMD)
+
+TARGET_AVX2 static size_t ndv_mask_byte_avx2(const uint8_t* src, uint8_t* mask,
+    size_t count, uint8_t ndv)
+{
+    size_t n = 0, i = 0;
+    const __m256i vndv = _mm256_set1_epi8(static_cast<char>(ndv));
+    const __m256i ones = _mm256_set1_epi8(-1);
+    for (; i + 32 <= count; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        __m256i eq = _mm256_cmpeq_epi8(v, vndv);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(mask + i), _mm256_xor_si256(eq, ones));
+        n += __builtin_popcount(static_cast<unsigned>(_mm256_movemask_epi8(eq)));
+    }
+    for (; i < count; i++) {
+        mask[i] = (src[i] == ndv) ? 0 : 255;
+        n += (src[i] == ndv);
+    }
+    return n;
+}
+
+TARGET_AVX2 static size_t ndv_mask_float_avx2(const float* src, uint8_t* mask,
+    size_t count, float ndv)
+{
+    size_t n = 0, i = 0;
+    const bool isnan_ndv = (ndv != ndv);
+    const __m256 vndv = _mm256_set1_ps(ndv);
+    const __m256i ones = _mm256_set1_epi8(-1);
+    // The packs work within lanes, the permute puts the bytes back in order
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    for (; i + 32 <= count; i += 32) {
+        __m256i eq[4];
+        for (int j = 0; j < 4; j++) {
+            __m256 v = _mm256_loadu_ps(src + i + 8 * j);
+            eq[j] = _mm256_castps_si256(isnan_ndv ? _mm256_cmp_ps(v, v, _CMP_UNORD_Q)
+                : _mm256_cmp_ps(v, vndv, _CMP_EQ_OQ));
+        }
+        __m256i b = _mm256_permutevar8x32_epi32(_mm256_packs_epi16(
+            _mm256_packs_epi32(eq[0], eq[1]), _mm256_packs_epi32(eq[2], eq[3])), order);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(mask + i), _mm256_xor_si256(b, ones));
+        n += __builtin_popcount(static_cast<unsigned>(_mm256_movemask_epi8(b)));
+    }
+    for (; i < count; i++) {
+        bool nd = isnan_ndv ? (src[i] != src[i]) : (src[i] == ndv);
+        mask[i] = nd ? 0 : 255;
+        n += nd;
+    }
+    return n;
+}
+
+TARGET_SSE41 static size_t ndv_mask_byte_sse41(const uint8_t* src, uint8_t* mask,
+    size_t count, uint8_t ndv)
+{
+    size_t n = 0, i = 0;
+    const __m128i vndv = _mm_set1_epi8(static_cast<char>(ndv));
+    const __m128i ones = _mm_set1_epi8(-1);
+    for (; i + 16 <= count; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i eq = _mm_cmpeq_epi8(v, vndv);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(mask + i), _mm_xor_si128(eq, ones));
+        n += __builtin_popcount(static_cast<unsigned>(_mm_movemask_epi8(eq)));
+    }
+    for (; i < count; i++) {
+        mask[i] = (src[i] == ndv) ? 0 : 255;
+        n += (src[i] == ndv);
+    }
+    return n;
+}
+
+TARGET_SSE41 static size_t ndv_mask_float_sse41(const float* src, uint8_t* mask,
+    size_t count, float ndv)
+{
+    size_t n = 0, i = 0;
+    const bool isnan_ndv = (ndv != ndv);
+    const __m128 vndv = _mm_set1_ps(ndv);
+    const __m128i ones = _mm_set1_epi8(-1);
+    // The comparison results are packed to bytes
+    for (; i + 16 <= count; i += 16) {
+        __m128i eq[4];
+        for (int j = 0; j < 4; j++) {
+            __m128 v = _mm_loadu_ps(src + i + 4 * j);
+            eq[j] = _mm_castps_si128(isnan_ndv ? _mm_cmpunord_ps(v, v) : _mm_cmpeq_ps(v, vndv));
+        }
+        __m128i b = _mm_packs_epi16(_mm_packs_epi32(eq[0], eq[1]), _mm_packs_epi32(eq[2], eq[3]));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(mask + i), _mm_xor_si128(b, ones));
+        n += __builtin_popcount(static_cast<unsigned>(_mm_movemask_epi8(b)));
+    }
+    for (; i < count; i++) {
+        bool nd = isnan_ndv ? (src[i] != src[i]) : (src[i] == ndv);
+        mask[i] = nd ? 0 : 255;
+        n += nd;
+    }
+    return n;
+}
+
+#endif
+
+size_t ndv_mask(const TiledRaster& raster, const void* page, uint8_t* mask) {
+    size_t count = page_values(raster);
+    if (!raster.has_ndv) {
+        memset(mask, 255, count);
+        return 0;
+    }
+
+#if defined(HAVE_X86_SIMD)
+    simd_level_t level = simd_level();
+    if (ICDT_Byte == raster.dt && SIMD_NONE != level) {
+        const uint8_t* src = static_cast<const uint8_t*>(page);
+        uint8_t ndv = saturate<uint8_t>(raster.ndv);
+        return (SIMD_AVX2 == level) ? ndv_mask_byte_avx2(src, mask, count, ndv)
+            : ndv_mask_byte_sse41(src, mask, count, ndv);
+    }
+    if (ICDT_Float32 == raster.dt && SIMD_NONE != level) {
+        const float* src = static_cast<const float*>(page);
+        float ndv = static_cast<float>(raster.ndv);
+        return (SIMD_AVX2 == level) ? ndv_mask_float_avx2(src, mask, count, ndv)
+            : ndv_mask_float_sse41(src, mask, count, ndv);
+    }
+#endif
+
+    size_t nodata = 0;
+    DT_DISPATCH(raster.dt, ndv_mask_t, page, mask, count, raster.ndv, &nodata);
+    return nodata;
+}
+
+//
+// Linear scaling to Byte, MinValue to 0 and MaxValue to 255, NoData to 0
+//
+
+// Value range, from the raster or from the data type
+static void scale_range(const TiledRaster& raster, double& vmin, double& vmax) {
+    vmin = 0;
+    vmax = 255;
+    switch (raster.dt) {
+    case ICDT_UInt16: vmax = 65535; break;
+    case ICDT_Int16: vmin = -32768; vmax = 32767; break;
+    case ICDT_UInt32: vmax = 4294967295.0; break;
+    case ICDT_Int32: vmin = -2147483648.0; vmax = 2147483647.0; break;
+    case ICDT_Float32:
+    case ICDT_Float64: vmin = 0; vmax = 1; break;
+    default: break;
+    }
+    if (raster.has_min)
+        vmin = raster.min;
+    if (raster.has_max)
+        vmax = raster.max;
+}
+
+template<typename T> static void scale_t(const void* src, uint8_t* dst, size_t count,
+    double vmin, double scale, int has_ndv, double ndv)
+{
+    const T* s = static_cast<const T*>(src);
+    T nd = saturate<T>(ndv);
+    for (size_t i = 0; i < count; i++) {
+        if (has_ndv && (s[i] == nd || (ndv != ndv && s[i] != s[i]))) {
+            dst[i] = 0;
+            continue;
+        }
+        dst[i] = saturate<uint8_t>((s[i] - vmin) * scale);
+    }
+}
+
+#if defined(HAVE_X86_SIMD)
+
+// The arithmetic is in double, as in scale_t, so the results are identical
+TARGET_AVX2 static void scale_float_avx2(const float* src, uint8_t* dst, size_t count,
+    double vmin, double scale, int has_ndv, double ndv)
+{
+    size_t i = 0;
+    const __m256d vmn = _mm256_set1_pd(vmin);
+    const __m256d vsc = _mm256_set1_pd(scale);
+    const __m256d top = _mm256_set1_pd(255.0);
+    const __m256 vndv = _mm256_set1_ps(static_cast<float>(ndv));
+    const bool isnan_ndv = (ndv != ndv);
+    for (; i + 8 <= count; i += 8) {
+        __m256 v = _mm256_loadu_ps(src + i);
+        __m256d lo = _mm256_mul_pd(_mm256_sub_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(v)), vmn), vsc);
+        __m256d hi = _mm256_mul_pd(_mm256_sub_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)), vmn), vsc);
+        __m128i w = round_pack_avx2(lo, hi, top);
+        __m128i b = _mm_packus_epi16(w, w);
+        if (has_ndv) {
+            // NoData becomes zero
+            __m256 nd = isnan_ndv ? _mm256_cmp_ps(v, v, _CMP_UNORD_Q) : _mm256_cmp_ps(v, vndv, _CMP_EQ_OQ);
+            __m256i m = _mm256_castps_si256(nd);
+            __m128i m16 = _mm_packs_epi32(_mm256_castsi256_si128(m), _mm256_extracti128_si256(m, 1));
+            b = _mm_andnot_si128(_mm_packs_epi16(m16, m16), b);
+        }
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + i), b);
+    }
+    scale_t<float>(src + i, dst + i, count - i, vmin, scale, has_ndv, ndv);
+}
+
+TARGET_SSE41 static void scale_float_sse41(const float* src, uint8_t* dst, size_t count,
+    double vmin, double scale, int has_ndv, double ndv)
+{
+    size_t i = 0;
+    const __m128d vmn = _mm_set1_pd(vmin);
+    const __m128d vsc = _mm_set1_pd(scale);
+    const __m128d top = _mm_set1_pd(255.0);
+    const __m128 vndv = _mm_set1_ps(static_cast<float>(ndv));
+    const bool isnan_ndv = (ndv != ndv);
+    __m128d d[4];
+    for (; i + 8 <= count; i += 8) {
+        __m128 v0 = _mm_loadu_ps(src + i);
+        __m128 v1 = _mm_loadu_ps(src + i + 4);
+        to_pd_sse41(v0, d);
+        to_pd_sse41(v1, d + 2);
+        for (int j = 0; j < 4; j++)
+            d[j] = _mm_mul_pd(_mm_sub_pd(d[j], vmn), vsc);
+        __m128i w = round_pack_sse41(d, top);
+        __m128i b = _mm_packus_epi16(w, w);
+        if (has_ndv) {
+            // NoData becomes zero
+            __m128 nd0 = isnan_ndv ? _mm_cmpunord_ps(v0, v0) : _mm_cmpeq_ps(v0, vndv);
+            __m128 nd1 = isnan_ndv ? _mm_cmpunord_ps(v1, v1) : _mm_cmpeq_ps(v1, vndv);
+            __m128i m16 = _mm_packs_epi32(_mm_castps_si128(nd0), _mm_castps_si128(nd1));
+            b = _mm_andnot_si128(_mm_packs_epi16(m16, m16), b);
+        }
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + i), b);
+    }
+    scale_t<float>(src + i, dst + i, count - i, vmin, scale, has_ndv, ndv);
+}
+
+#endif
+
+void scale_to_byte(const TiledRaster& raster, const void* page, uint8_t* dst) {
+    size_t count = page_values(raster);
+    double vmin, vmax;
+    scale_range(raster, vmin, vmax);
+    double scale = (vmax > vmin) ? 255.0 / (vmax - vmin) : 0.0;
+
+#if defined(HAVE_X86_SIMD)
+    simd_level_t level = simd_level();
+    if (ICDT_Float32 == raster.dt && SIMD_NONE != level) {
+        if (SIMD_AVX2 == level)
+            scale_float_avx2(static_cast<const float*>(page), dst, count, vmin, scale,
+                raster.has_ndv, raster.ndv);
+        else
+            scale_float_sse41(static_cast<const float*>(page), dst, count, vmin, scale,
+                raster.has_ndv, raster.ndv);
+        return;
+    }
+#endif
+
+    DT_DISPATCH(raster.dt, scale_t, page, dst, count, vmin, scale, raster.has_ndv, raster.ndv);
+}
+
+//
+// 2x2 reduction of a page into a w by h window
+//
+
+template<typename T> static void reduce_t(const void* vsrc, size_t sw, size_t sh,
+    void* vdst, size_t dstride, size_t w, size_t h, size_t c, int kernel, int has_ndv,
+    double dndv)
+{
+    const T* src = static_cast<const T*>(vsrc);
+    T* dst = static_cast<T*>(vdst);
+    size_t sstride = sw * c;
+    T ndv = saturate<T>(dndv);
+    for (size_t y = 0; y < h; y++) {
+        const T* s0 = src + 2 * y * sstride;
+        const T* s1 = (2 * y + 1 < sh) ? s0 + sstride : s0; // Odd size, repeat last line
+        T* d = dst + y * dstride;
+        for (size_t x = 0; x < w; x++) {
+            size_t x0 = 2 * x * c;
+            size_t x1 = (2 * x + 1 < sw) ? x0 + c : x0;
+            for (size_t b = 0; b < c; b++) {
+                if (REDUCE_NEAREST == kernel) {
+                    d[x * c + b] = s0[x0 + b];
+                    continue;
+                }
+                T v[4] = { s0[x0 + b], s0[x1 + b], s1[x0 + b], s1[x1 + b] };
+                double sum = 0;
+                int count = 0;
+                for (int i = 0; i < 4; i++) {
+                    if (REDUCE_AVG_NDV == kernel && has_ndv && v[i] == ndv)
+                        continue;
+                    sum += v[i];
+                    count++;
+                }
+                d[x * c + b] = count ? saturate<T>(sum / count) : ndv;
+            }
+        }
+    }
+}
+
+#if defined(HAVE_X86_SIMD)
+
+// Byte average, the two rows are added as 16 bit values with SIMD
+// then adjacent pixels are added in scalar code, which works for any band count
+// Only needs SSE2, it is used at every SIMD level
+TARGET_SSE2 static void reduce_byte_sse2(const uint8_t* src, size_t sw, size_t sh,
+    uint8_t* dst, size_t dstride, size_t w, size_t h, size_t c)
+{
+    size_t sstride = sw * c;
+    vector<uint16_t> sums(sstride);
+    const __m128i zero = _mm_setzero_si128();
+    for (size_t y = 0; y < h; y++) {
+        const uint8_t* s0 = src + 2 * y * sstride;
+        const uint8_t* s1 = (2 * y + 1 < sh) ? s0 + sstride : s0;
+        size_t i = 0;
+        for (; i + 16 <= sstride; i += 16) {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s0 + i));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s1 + i));
+            __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+            __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(&sums[i]), lo);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(&sums[i + 8]), hi);
+        }
+        for (; i < sstride; i++)
+            sums[i] = s0[i] + s1[i];
+
+        uint8_t* d = dst + y * dstride;
+        for (size_t x = 0; x < w; x++) {
+            size_t x0 = 2 * x * c;
+            size_t x1 = (2 * x + 1 < sw) ? x0 + c : x0;
+            for (size_t b = 0; b < c; b++)
+                d[x * c + b] = static_cast<uint8_t>((sums[x0 + b] + sums[x1 + b] + 2) >> 2);
+        }
+    }
+}
+
+#endif
+
+void reduce_2x2(const TiledRaster& raster, const void* src, void* dst, size_t dstride,
+    size_t w, size_t h, int kernel)
+{
+    size_t sw = raster.pagesize.x, sh = raster.pagesize.y, c = raster.pagesize.c;
+
+#if defined(HAVE_X86_SIMD)
+    if (SIMD_NONE != simd_level() && ICDT_Byte == raster.dt && REDUCE_NEAREST != kernel
+        && (REDUCE_AVG == kernel || !raster.has_ndv))
+    {
+        reduce_byte_sse2(static_cast<const uint8_t*>(src), sw, sh,
+            static_cast<uint8_t*>(dst), dstride, w, h, c);
+        return;
+    }
+#endif
+
+    DT_DISPATCH(raster.dt, reduce_t, src, sw, sh, dst, dstride, w, h, c, kernel,
+        raster.has_ndv, raster.ndv);
+}
+
+//
+// Fill a buffer with a value
+//
+
+template<typename T> static void fill_t(void* dst, size_t count, double value) {
+    T v = saturate<T>(value);
+    T* d = static_cast<T*>(dst);
+    std::fill(d, d + count, v);
+}
+
+void fill_values(void* dst, ICDDataType dt, size_t count, double value) {
+    DT_DISPATCH(dt, fill_t, dst, count, value);
+}
+
+//
+// Empty page detection
+//
+
+// Byte compare of a buffer with a repeated value of tsize bytes, tsize is a power of two up to 8
+static bool all_equal_scalar(const uint8_t* p, size_t bytes, const uint8_t* value, size_t tsize) {
+    for (size_t i = 0; i < bytes; i += tsize)
+        if (memcmp(p + i, value, tsize))
+            return false;
+    return true;
+}
+
+#if defined(HAVE_X86_SIMD)
+
+TARGET_SSE41 static bool all_equal_sse41(const uint8_t* p, size_t bytes, const uint8_t* value,
+    size_t tsize)
+{
+    uint8_t pattern[16];
+    for (size_t i = 0; i < 16; i++)
+        pattern[i] = value[i % tsize];
+    const __m128i vp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pattern));
+    size_t i = 0;
+    for (; i + 64 <= bytes; i += 64) {
+        __m128i d = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)), vp);
+        d = _mm_or_si128(d, _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + 16)), vp));
+        d = _mm_or_si128(d, _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + 32)), vp));
+        d = _mm_or_si128(d, _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + 48)), vp));
+        if (!_mm_testz_si128(d, d))
+            return false;
+    }
+    return all_equal_scalar(p + i, bytes - i, value, tsize);
+}
+
+TARGET_AVX2 static bool all_equal_avx2(const uint8_t* p, size_t bytes, const uint8_t* value,
+    size_t tsize)
+{
+    uint8_t pattern[32];
+    for (size_t i = 0; i < 32; i++)
+        pattern[i] = value[i % tsize];
+    const __m256i vp = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pattern));
+    size_t i = 0;
+    for (; i + 128 <= bytes; i += 128) {
+        __m256i d = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i)), vp);
+        d = _mm256_or_si256(d, _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i + 32)), vp));
+        d = _mm256_or_si256(d, _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i + 64)), vp));
+        d = _mm256_or_si256(d, _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i + 96)), vp));
+        if (!_mm256_testz_si256(d, d))
+            return false;
+    }
+    return all_equal_scalar(p + i, bytes - i, value, tsize);
+}
+
+#endif
+
+static bool all_equal(const uint8_t* p, size_t bytes, const uint8_t* value, size_t tsize) {
+#if defined(HAVE_X86_SIMD)
+    switch (simd_level()) {
+    case SIMD_AVX2: return all_equal_avx2(p, bytes, value, tsize);
+    case SIMD_SSE41: return all_equal_sse41(p, bytes, value, tsize);
+    default: break;
+    }
+#endif
+    return all_equal_scalar(p, bytes, value, tsize);
+}
+
+template<typename T> static void all_nan_t(const void* src, size_t count, bool* result) {
+    const T* s = static_cast<const T*>(src);
+    for (size_t i = 0; i < count; i++)
+        if (s[i] == s[i]) {
+            *result = false;
+            return;
+        }
+    *result = true;
+}
+
+// Last band is zero everywhere
+template<typename T> static void transparent_t(const void* src, size_t count, size_t c,
+    bool* result)
+{
+    const T* s = static_cast<const T*>(src);
+    for (size_t i = c - 1; i < count; i += c)
+        if (s[i]) {
+            *result = false;
+            return;
+        }
+    *result = true;
+}
+
+int is_empty_page(const TiledRaster& raster, const void* page) {
+    size_t count = page_values(raster);
+    size_t tsize = getTypeSize(raster.dt);
+    if (0 == count || 0 == tsize || tsize > 8)
+        return false;
+
+    bool result = false;
+    // Alpha band, for two or four band Byte and UInt16 rasters
+    if ((2 == raster.pagesize.c || 4 == raster.pagesize.c)
+        && (ICDT_Byte == raster.dt || ICDT_UInt16 == raster.dt))
+    {
+        if (ICDT_Byte == raster.dt)
+            transparent_t<uint8_t>(page, count, raster.pagesize.c, &result);
+        else
+            transparent_t<uint16_t>(page, count, raster.pagesize.c, &result);
+        if (result)
+            return true;
+    }
+
+    double value = raster.has_ndv ? raster.ndv : 0.0;
+    if (value != value) {
+        if (ICDT_Float32 == raster.dt)
+            all_nan_t<float>(page, count, &result);
+        else if (ICDT_Float64 == raster.dt)
+            all_nan_t<double>(page, count, &result);
+        return result;
+    }
+
+    // Compare bytes, with the value in the page data type
+    uint8_t pattern[8];
+    fill_values(pattern, raster.dt, 1, value);
+    return all_equal(static_cast<const uint8_t*>(page), count * tsize, pattern, tsize);
+}
+
+NS_AHTSE_END
@@ -0,0 +1,414 @@
+/*
+* ahtse_raster.cpp
+*
+* Raster processing helpers, built on the ICD codecs
+*
+* (C) Lucian Plesea 2019-2021
+*
+*/
+
+#include "ahtse.h"
+
+using namespace std;
+NS_ICD_USE
+
+NS_AHTSE_START
+
+// Encode a page in the requested format, with the codec defaults if conf is null
+// IMG_ANY picks JPEG for one or three bands and PNG otherwise
+// The error message is allocated from pool, the codec one can be in its params
+static const char* encode_page(apr_pool_t* pool, const TiledRaster& raster, IMG_T fmt,
+    storage_manager& raw, storage_manager& dst, const transcode_conf_t* conf = nullptr)
+{
+    Raster praster(raster.pageraster());
+    if (IMG_ANY == fmt)
+        fmt = (1 == raster.pagesize.c || 3 == raster.pagesize.c) ? IMG_JPEG : IMG_PNG;
+    const char* message = nullptr;
+    switch (fmt) {
+    case IMG_JPEG: {
+        jpeg_params params(praster);
+        if (conf)
+            params.quality = conf->quality;
+        message = jpeg_encode(params, raw, dst);
+        break;
+    }
+    case IMG_PNG: {
+        png_params params(praster);
+        if (conf)
+            params.compression_level = conf->png_level;
+        message = png_encode(params, raw, dst);
+        break;
+    }
+    case IMG_LERC: {
+        lerc_params params(praster);
+        params.prec = static_cast<float>(raster.precision);
+        if (conf && conf->precision >= 0)
+            params.prec = static_cast<float>(conf->precision);
+        message = lerc_encode(params, raw, dst);
+        break;
+    }
+    default:
+        return "Unsupported output format";
+    }
+    return message ? apr_pstrdup(pool, message) : nullptr;
+}
+
+int get_overview_tile(request_rec* r, const char* source, const sloc_t& tile,
+    const char* suffix, const TiledRaster& raster, int kernel, storage_manager& dst,
+    char** psETag, const char** msg)
+{
+    size_t level = static_cast<size_t>(tile.l) + raster.skip;
+    if (level + 1 >= raster.n_levels || tile.x >= raster.rsets[level].w
+        || tile.y >= raster.rsets[level].h)
+    {
+        if (msg)
+            *msg = "No finer level for overview";
+        return HTTP_BAD_REQUEST;
+    }
+
+    const rset& next = raster.rsets[level + 1];
+    size_t px = raster.pagesize.x, py = raster.pagesize.y;
+    // Output window size for each child, the first ones might be larger for odd page sizes
+    size_t hw[2] = { (px + 1) / 2, px / 2 }, hh[2] = { (py + 1) / 2, py / 2 };
+
+    // Fetch the children, missing ones stay empty
+    page_t pages[4];
+    string key("overview ");
+    key.append(pMLRC(r->pool, source, tile, suffix));
+    int found = 0;
+    bool cacheable = true;
+    for (int i = 0; i < 4; i++) {
+        sloc_t child(tile);
+        child.l = tile.l + 1;
+        child.x = 2 * tile.x + (i & 1);
+        child.y = 2 * tile.y + (i >> 1);
+        char* ETag = nullptr;
+        if (child.x < next.w && child.y < next.h) {
+            int status = get_decoded_tile(r, source, child, suffix, raster, pages[i], &ETag, msg);
+            if (APR_SUCCESS != status && HTTP_NOT_FOUND != status)
+                return status;
+        }
+        if (pages[i])
+            found++;
+        // A child without ETag can change without notice
+        if (pages[i] && !ETag)
+            cacheable = false;
+        key.append(" ").append(ETag ? ETag : "-");
+    }
+
+    if (0 == found)
+        return HTTP_NOT_FOUND;
+
+    // The ETag is a hash of the children ETags and the kernel
+    uint64_t hash = raster.seed ^ 0xcbf29ce484222325ULL;
+    for (auto c : key)
+        hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3ULL;
+    hash ^= kernel;
+    char ETag[16];
+    tobase32(hash, ETag);
+    if (psETag)
+        *psETag = apr_pstrdup(r->pool, ETag);
+
+    key.append(" ").append(ETag);
+    page_t cached = cacheable ? page_cache_get(key) : page_t();
+    if (cached) {
+        if (cached->size() > dst.size)
+            return HTTP_REQUEST_ENTITY_TOO_LARGE;
+        memcpy(dst.buffer, cached->data(), cached->size());
+        dst.size = cached->size();
+        return APR_SUCCESS;
+    }
+
+    size_t pagebytes = raster.pagebytes();
+    size_t tsize = getTypeSize(raster.dt);
+    size_t line = px * raster.pagesize.c * tsize;
+    vector<uint8_t> out(pagebytes);
+    fill_values(out.data(), raster.dt, pagebytes / tsize, raster.has_ndv ? raster.ndv : 0);
+    for (int i = 0; i < 4; i++) {
+        if (!pages[i])
+            continue;
+        int dx = i & 1, dy = i >> 1;
+        uint8_t* window = out.data() + dy * hh[0] * line + dx * hw[0] * raster.pagesize.c * tsize;
+        reduce_2x2(raster, pages[i]->data(), window, px * raster.pagesize.c, hw[dx], hh[dy], kernel);
+    }
+
+    storage_manager raw(out.data(), pagebytes);
+    const char* error_message = encode_page(r->pool, raster, raster.format, raw, dst);
+    if (error_message) {
+        if (msg)
+            *msg = error_message;
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    const uint8_t* encoded = static_cast<const uint8_t*>(dst.buffer);
+    if (cacheable)
+        page_cache_put(key, make_shared<vector<uint8_t>>(encoded, encoded + dst.size));
+    return APR_SUCCESS;
+}
+
+int sendPage(request_rec* r, const TiledRaster& raster, const void* page,
+    storage_manager& dst, const char* ETag, const char** msg)
+{
+    if (is_empty_page(raster, page))
+        return sendEmptyTile(r, raster.missing);
+
+    if (ETag) {
+        apr_table_setn(r->headers_out, "ETag", ETag);
+        if (etagMatches(r, ETag))
+            return HTTP_NOT_MODIFIED;
+    }
+
+    storage_manager raw(const_cast<void*>(page), raster.pagebytes());
+    const char* error_message = encode_page(r->pool, raster, raster.format, raw, dst);
+    if (error_message) {
+        if (msg)
+            *msg = error_message;
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    return sendImage(r, dst);
+}
+
+// Known output formats, by query parameter value and by mime type
+static const struct {
+    const char* name;
+    const char* mime;
+    IMG_T fmt;
+} formats[] = {
+    { "jpeg", "image/jpeg", IMG_JPEG },
+    { "jpg", "image/jpg", IMG_JPEG },
+    { "png", "image/png", IMG_PNG },
+    { "lerc", "raster/lerc", IMG_LERC },
+};
+
+// Formats which can hold the raster data type
+static bool can_encode(const TiledRaster& raster, IMG_T fmt) {
+    switch (fmt) {
+    case IMG_JPEG:
+        return ICDT_Byte == raster.dt || ICDT_UInt16 == raster.dt;
+    case IMG_PNG:
+        return getTypeSize(raster.dt) <= 2;
+    case IMG_LERC:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Removes leading and trailing white space, in place
+static char* trim(char* s) {
+    while (' ' == *s || '\t' == *s)
+        s++;
+    char* end = s + strlen(s);
+    while (end > s && (' ' == end[-1] || '\t' == end[-1]))
+        *--end = 0;
+    return s;
+}
+
+IMG_T negotiate_format(request_rec* r, const TiledRaster& raster) {
+    // The query parameter wins
+    apr_hash_t* args = argparse(r);
+    const char* value = args ?
+        static_cast<const char*>(apr_hash_get(args, "format", APR_HASH_KEY_STRING)) : nullptr;
+    if (value) {
+        for (auto& f : formats)
+            if (!ap_cstr_casecmp(value, f.name) || !ap_cstr_casecmp(value, f.mime))
+                return can_encode(raster, f.fmt) ? f.fmt : raster.format;
+        return raster.format;
+    }
+
+    // The response depends on the Accept header, even when there is none
+    int choices = 0;
+    for (IMG_T fmt : { IMG_JPEG, IMG_PNG, IMG_LERC })
+        choices += can_encode(raster, fmt);
+    if (choices > 1)
+        apr_table_mergen(r->headers_out, "Vary", "Accept");
+
+    const char* accept = apr_table_get(r->headers_in, "Accept");
+    if (!accept)
+        return raster.format;
+    // The known type with the highest weight, the first one on ties, q=0 means not acceptable
+    IMG_T best = raster.format;
+    double best_q = 0;
+    while (*accept) {
+        const char* params = ap_getword(r->pool, &accept, ',');
+        char* type = trim(ap_getword(r->pool, &params, ';'));
+        double q = 1;
+        while (*params) {
+            char* param = trim(ap_getword(r->pool, &params, ';'));
+            if (('q' == *param || 'Q' == *param) && '=' == param[1])
+                q = atof(param + 2);
+        }
+        if (q <= best_q)
+            continue;
+        if (!strcmp(type, "*/*") || !strcmp(type, "image/*")) {
+            best = raster.format;
+            best_q = q;
+            continue;
+        }
+        for (auto& f : formats)
+            if (!ap_cstr_casecmp(type, f.mime) && can_encode(raster, f.fmt)) {
+                best = f.fmt;
+                best_q = q;
+                break;
+            }
+    }
+    return best;
+}
+
+int transcode_tile(request_rec* r, const char* source, const sloc_t& tile,
+    const char* suffix, const TiledRaster& raster, IMG_T fmt, const transcode_conf_t& conf,
+    storage_manager& dst, char** psETag, const char** msg)
+{
+    void* buffer = get_tile_buffer(r->pool, raster.maxtilesize);
+    if (!buffer)
+        return HTTP_INTERNAL_SERVER_ERROR;
+    storage_manager src(buffer, raster.maxtilesize);
+    char* sETag = nullptr;
+    int status = get_remote_tile(r, source, tile, src, &sETag, suffix);
+    if (APR_SUCCESS != status) {
+        release_tile_buffer(r->pool, buffer);
+        return status;
+    }
+
+    // Already in a suitable format, pass it through
+    Raster sraster;
+    if (!image_peek(src, sraster) && (sraster.format == fmt
+        || (IMG_ANY == fmt && (IMG_JPEG == sraster.format || IMG_PNG == sraster.format))))
+    {
+        status = APR_SUCCESS;
+        if (src.size <= dst.size) {
+            memcpy(dst.buffer, src.buffer, src.size);
+            dst.size = src.size;
+        }
+        else
+            status = HTTP_REQUEST_ENTITY_TOO_LARGE;
+        release_tile_buffer(r->pool, buffer);
+        if (psETag)
+            *psETag = sETag;
+        return status;
+    }
+
+    // Each variant has its own ETag, from the source ETag, the format and the settings
+    string path(pMLRC(r->pool, source, tile, suffix));
+    string key;
+    if (sETag) {
+        key = path;
+        key.append(" ").append(sETag);
+        key.append(apr_psprintf(r->pool, " %d %d %d %g", static_cast<int>(fmt),
+            conf.quality, conf.png_level, conf.precision));
+        uint64_t hash = raster.seed ^ 0xcbf29ce484222325ULL;
+        for (auto c : key)
+            hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3ULL;
+        char ETag[16];
+        tobase32(hash, ETag);
+        if (psETag)
+            *psETag = apr_pstrdup(r->pool, ETag);
+        key.append(" variant");
+
+        page_t cached = page_cache_get(key);
+        if (cached) {
+            release_tile_buffer(r->pool, buffer);
+            if (cached->size() > dst.size)
+                return HTTP_REQUEST_ENTITY_TOO_LARGE;
+            memcpy(dst.buffer, cached->data(), cached->size());
+            dst.size = cached->size();
+            return APR_SUCCESS;
+        }
+    }
+    else if (psETag) {
+        *psETag = nullptr;
+    }
+
+    // Decoded pages are shared with get_decoded_tile
+    string pkey = path + " " + (sETag ? sETag : "");
+    page_t page = sETag ? page_cache_get(pkey) : page_t();
+    if (!page) {
+        auto decoded = make_shared<vector<uint8_t>>(raster.pagebytes());
+        codec_params params(raster.pageraster());
+        const char* error_message = stride_decode(params, src, decoded->data());
+        release_tile_buffer(r->pool, buffer);
+        if (error_message) {
+            // The message can be in params
+            if (msg)
+                *msg = apr_pstrdup(r->pool, error_message);
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+        page = decoded;
+        if (sETag)
+            page_cache_put(pkey, page);
+    }
+    else
+        release_tile_buffer(r->pool, buffer);
+
+    storage_manager raw(const_cast<uint8_t*>(page->data()), page->size());
+    const char* error_message = encode_page(r->pool, raster, fmt, raw, dst, &conf);
+    if (error_message) {
+        if (msg)
+            *msg = error_message;
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    const uint8_t* encoded = static_cast<const uint8_t*>(dst.buffer);
+    if (sETag)
+        page_cache_put(key, make_shared<vector<uint8_t>>(encoded, encoded + dst.size));
+    return APR_SUCCESS;
+}
+
+const char* mosaic(const TiledRaster& raster, const vector<tile_window_t>& tiles,
+    const storage_manager* srcs, void* dst, size_t width, size_t height)
+{
+    size_t px = getTypeSize(raster.dt) * raster.pagesize.c; // Bytes per pixel
+    size_t line = width * px;
+    uint8_t* out = static_cast<uint8_t*>(dst);
+
+    // Fill first, unless the tiles cover all of dst
+    size_t covered = 0;
+    for (size_t i = 0; i < tiles.size(); i++)
+        if (srcs[i].buffer && srcs[i].size)
+            covered += tiles[i].w * tiles[i].h;
+    if (covered < width * height)
+        fill_values(dst, raster.dt, width * height * raster.pagesize.c,
+            raster.has_ndv ? raster.ndv : 0);
+
+    // The codec message might be in params, it is copied
+    vector<string> errors(tiles.size());
+    parallel_for(tiles.size(), [&](size_t i) {
+        const tile_window_t& t = tiles[i];
+        if (!srcs[i].buffer || !srcs[i].size || !t.w || !t.h)
+            return;
+        storage_manager src(srcs[i]);
+        codec_params params(raster.pageraster());
+        uint8_t* corner = out + t.oy * line + t.ox * px;
+        // A whole tile which fits decodes in place
+        if (0 == t.x && 0 == t.y && t.w == raster.pagesize.x && t.h == raster.pagesize.y) {
+            params.line_stride = line;
+            const char* error_message = stride_decode(params, src, corner);
+            if (error_message)
+                errors[i] = error_message;
+            return;
+        }
+
+        // Edge tiles are decoded whole, then the window rows are copied
+        vector<uint8_t> page(raster.pagebytes());
+        const char* error_message = stride_decode(params, src, page.data());
+        if (error_message) {
+            errors[i] = error_message;
+            return;
+        }
+        size_t pline = raster.pagesize.x * px;
+        const uint8_t* from = page.data() + t.y * pline + t.x * px;
+        for (size_t row = 0; row < t.h; row++)
+            memcpy(corner + row * line, from + row * pline, t.w * px);
+    });
+
+    // Kept until the next call from this thread
+    static thread_local string message;
+    for (auto& e : errors)
+        if (!e.empty()) {
+            message = e;
+            return message.c_str();
+        }
+    return nullptr;
+}
+
+NS_AHTSE_END
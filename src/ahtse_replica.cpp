@@ -0,0 +1,293 @@
+/*
+* ahtse_replica.cpp
+*
+* Replicated sources
+*
+* A source can be a comma separated list of equivalent paths or URLs. The first one is
+* the primary, which modules use to build request URLs. The fetch helpers map a URL under
+* the primary to all the replicas, fastest first by the EWMA of their latency, and move
+* to the next one when a request fails
+* Range reads from http:// replicas can be hedged, a second request goes out when the
+* first one takes longer than a percentile of the recent latencies. The requests run on
+* the worker pool and go through the circuit breaker
+*
+* (C) Lucian Plesea 2019-2021
+*
+*/
+
+#include "ahtse.h"
+#include <httpd.h>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+
+using namespace std;
+NS_ICD_USE
+
+NS_AHTSE_START
+
+// Weight of the last sample in the latency average
+#define RP_ALPHA 0.2
+// Latency samples kept for the hedging delay
+#define RP_SAMPLES 128
+// Samples needed before the percentile is used
+#define RP_MIN_SAMPLES 16
+// Hedging delay until there are enough samples, in microseconds
+#define RP_DEFAULT_DELAY 200000
+
+struct replica_t {
+    replica_t(const string& p) : prefix(p), ewma(0), failures(0) {}
+    string prefix;
+    double ewma; // Microseconds, zero until the first sample
+    apr_uint32_t failures; // Consecutive
+};
+
+struct replica_set_t {
+    replica_set_t() : next(0) {}
+    mutex lock;
+    vector<replica_t> replicas; // The first one is the primary
+    // Recent latencies of successful requests, a ring
+    vector<apr_time_t> samples;
+    size_t next;
+};
+
+static mutex rp_lock;
+static vector<shared_ptr<replica_set_t>> rp_sets;
+static atomic<double> rp_percentile(0);
+
+void set_replica_hedging(double percentile) {
+    rp_percentile = percentile;
+}
+
+const char* set_replicas(apr_pool_t* p, const char* sources, const char** primary) {
+    auto rs = make_shared<replica_set_t>();
+    string list(sources);
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == string::npos)
+            end = list.size();
+        if (end == start)
+            return "Empty source in list";
+        rs->replicas.push_back(replica_t(list.substr(start, end - start)));
+        start = end + 1;
+    }
+
+    *primary = apr_pstrdup(p, rs->replicas[0].prefix.c_str());
+    if (rs->replicas.size() < 2)
+        return nullptr;
+    lock_guard<mutex> guard(rp_lock);
+    // Replaces a previous set with the same primary
+    for (auto& s : rp_sets)
+        if (s->replicas[0].prefix == rs->replicas[0].prefix) {
+            s = rs;
+            return nullptr;
+        }
+    rp_sets.push_back(rs);
+    return nullptr;
+}
+
+// True if prefix is url or a folder of it
+static bool path_prefix(const char* url, const string& prefix) {
+    size_t len = prefix.size();
+    return !strncmp(url, prefix.c_str(), len)
+        && (0 == url[len] || '/' == url[len] || (len && '/' == prefix[len - 1]));
+}
+
+// The set and the replica index for url, the longest replica that is a prefix of url
+static shared_ptr<replica_set_t> find_set(const char* url, size_t* idx = nullptr) {
+    lock_guard<mutex> guard(rp_lock);
+    shared_ptr<replica_set_t> found;
+    size_t len = 0;
+    for (auto& s : rp_sets)
+        for (size_t i = 0; i < s->replicas.size(); i++) {
+            const string& prefix = s->replicas[i].prefix;
+            if (prefix.size() > len && path_prefix(url, prefix)) {
+                found = s;
+                len = prefix.size();
+                if (idx)
+                    *idx = i;
+            }
+        }
+    return found;
+}
+
+vector<string> replica_urls(const char* url) {
+    vector<string> urls;
+    size_t idx = 0;
+    auto rs = find_set(url, &idx);
+    if (!rs) {
+        urls.push_back(url);
+        return urls;
+    }
+
+    const char* tail = url + rs->replicas[idx].prefix.size();
+    vector<pair<double, string>> order;
+    {
+        lock_guard<mutex> guard(rs->lock);
+        for (auto& rp : rs->replicas)
+            // Failing replicas go last, unknown ones are tried early
+            order.push_back(make_pair(rp.ewma + rp.failures * 1e9, rp.prefix + tail));
+    }
+    stable_sort(order.begin(), order.end(),
+        [](const pair<double, string>& a, const pair<double, string>& b) { return a.first < b.first; });
+    for (auto& o : order)
+        urls.push_back(o.second);
+    return urls;
+}
+
+void replica_record(const char* url, bool failed, apr_time_t latency) {
+    size_t idx = 0;
+    auto rs = find_set(url, &idx);
+    if (!rs)
+        return;
+
+    lock_guard<mutex> guard(rs->lock);
+    replica_t& rp = rs->replicas[idx];
+    if (failed) {
+        rp.failures++;
+        return;
+    }
+    rp.failures = 0;
+    rp.ewma = (0 == rp.ewma) ? latency : RP_ALPHA * latency + (1 - RP_ALPHA) * rp.ewma;
+    if (rs->samples.size() < RP_SAMPLES)
+        rs->samples.push_back(latency);
+    else
+        rs->samples[rs->next++ % RP_SAMPLES] = latency;
+}
+
+// Delay before a hedged request, 0 if hedging is off
+static apr_time_t hedge_delay(const char* url) {
+    double pct = rp_percentile;
+    if (pct <= 0)
+        return 0;
+    auto rs = find_set(url);
+    if (!rs)
+        return 0;
+    vector<apr_time_t> samples;
+    {
+        lock_guard<mutex> guard(rs->lock);
+        samples = rs->samples;
+    }
+    if (samples.size() < RP_MIN_SAMPLES)
+        return RP_DEFAULT_DELAY;
+    size_t k = min(samples.size() - 1, static_cast<size_t>(pct / 100 * samples.size()));
+    nth_element(samples.begin(), samples.begin() + k, samples.end());
+    return max(samples[k], static_cast<apr_time_t>(1000));
+}
+
+// Shared by the requests of a hedged read, outlives the caller if needed
+struct hedge_t {
+    hedge_t() : done(false), pending(0), failed(0), status(0), total(0) {}
+    mutex lock;
+    condition_variable cv;
+    bool done;
+    int pending, failed;
+    int status; // Set when a replica answers that the range is past the end of the file
+    vector<char> buffer;
+    apr_size_t total;
+    string validator;
+};
+
+// Runs on the worker pool, the caller might be gone when it completes
+static void hedge_request(shared_ptr<hedge_t> h, string url, apr_off_t offset, apr_size_t size,
+    int probe)
+{
+    vector<char> buffer(size);
+    storage_manager body(buffer.data(), size);
+    http_result_t result;
+    apr_status_t stat = APR_EGENERAL;
+    apr_pool_t* pool;
+    apr_time_t start = apr_time_now();
+    if (APR_SUCCESS == apr_pool_create(&pool, nullptr)) {
+        apr_table_t* headers = apr_table_make(pool, 1);
+        apr_table_setn(headers, "Range", apr_psprintf(pool,
+            "bytes=%" APR_UINT64_T_FMT "-%" APR_UINT64_T_FMT,
+            static_cast<apr_uint64_t>(offset), static_cast<apr_uint64_t>(offset + size - 1)));
+        stat = http_get(url.c_str(), body, result, headers);
+        apr_pool_destroy(pool);
+    }
+    // A short read is complete if the file ends there
+    apr_size_t end = static_cast<apr_size_t>(offset + body.size);
+    bool ok = APR_SUCCESS == stat
+        && ((HTTP_PARTIAL_CONTENT == result.status && (body.size == size || end == result.total))
+        || (HTTP_OK == result.status && 0 == offset && (body.size == size || !result.overflow)));
+    if (ok && body.size < size)
+        result.total = end;
+    apr_time_t latency = apr_time_now() - start;
+    bool eof = HTTP_RANGE_NOT_SATISFIABLE == result.status;
+    replica_record(url.c_str(), !ok && !eof, latency);
+    // http:// sources don't need the request
+    breaker_record(nullptr, url.c_str(), ok ? APR_SUCCESS : (result.status ? result.status : stat),
+        latency, probe);
+
+    lock_guard<mutex> guard(h->lock);
+    h->pending--;
+    if (!ok)
+        h->failed++;
+    if (eof)
+        h->status = result.status;
+    if (ok && !h->done) {
+        h->done = true;
+        buffer.resize(body.size);
+        h->buffer.swap(buffer);
+        h->total = result.total;
+        h->validator = result.ETag.empty() ? result.last_modified : result.ETag;
+    }
+    h->cv.notify_all();
+}
+
+int hedged_range_read(request_rec* r, const vector<string>& urls, apr_off_t offset,
+    storage_manager& dst, apr_size_t* total, string* validator)
+{
+    apr_time_t delay = hedge_delay(urls[0].c_str());
+    if (0 == delay)
+        return DECLINED;
+
+    auto h = make_shared<hedge_t>();
+    size_t next = 0;
+    int shed = 0, probe = 0;
+    unique_lock<mutex> lock(h->lock);
+    while (!h->done && !h->status) {
+        // Start the next request when one fails or the last one is slow
+        // Replicas with an open breaker are skipped
+        while (next < urls.size() && 0 != (shed = breaker_check(r, urls[next].c_str(), &probe)))
+            next++;
+        if (next < urls.size()) {
+            h->pending++;
+            string url = urls[next++];
+            apr_size_t size = dst.size;
+            worker_submit([h, url, offset, size, probe]() {
+                hedge_request(h, url, offset, size, probe);
+            });
+        }
+        else if (0 == h->pending)
+            break;
+        int failed = h->failed;
+        auto wake = [&h, failed]() {
+            return h->done || h->status || h->failed != failed || 0 == h->pending;
+        };
+        if (next < urls.size())
+            h->cv.wait_for(lock, chrono::microseconds(delay), wake);
+        else
+            h->cv.wait(lock, wake);
+    }
+    if (!h->done) {
+        if (h->status)
+            return h->status;
+        return (0 == h->failed && shed) ? shed : HTTP_BAD_GATEWAY;
+    }
+    memcpy(dst.buffer, h->buffer.data(), min<size_t>(dst.size, h->buffer.size()));
+    // The total is not always known, the read worked
+    *total = h->total ? h->total : static_cast<apr_size_t>(offset + dst.size);
+    if (validator)
+        *validator = h->validator;
+    return APR_SUCCESS;
+}
+
+NS_AHTSE_END
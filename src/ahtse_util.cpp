@@ -22,6 +22,7 @@
 #include <http_protocol.h>
 #include <http_request.h>
 #include <apr_strings.h>
+#include <apr_buckets.h>
 #include <ap_regex.h>
 #include <http_log.h>
 
@@ -33,10 +34,12 @@
 #include <clocale>
 #include <cstring>
 #include <algorithm>
-
-// Need zlib to ungzip compressed input
-// The apache inflate filter doesn't activate on subrequests, it can't be used
-#include <zlib.h>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <unordered_map>
+#include <memory>
+#include <atomic>
 
 #include "ahtse.h"
 
@@ -272,6 +275,83 @@ done:
     return message;
 }
 
+// Fraction of a pixel ignored at the bbox edges, absorbs rounding
+#define PLAN_EPS 1e-6
+
+const char* plan_bbox(const TiledRaster& raster, const bbox_t& bbox,
+    size_t width, size_t height, tile_plan_t& plan)
+{
+    plan.tiles.clear();
+    if (0 == width || 0 == height || !(bbox.xmax > bbox.xmin) || !(bbox.ymax > bbox.ymin))
+        return "Invalid bounding box or size";
+
+    // Requested resolution, the finer of the two axes
+    double res = min((bbox.xmax - bbox.xmin) / width, (bbox.ymax - bbox.ymin) / height);
+
+    // Coarsest usable level that is fine enough, defaults to the finest
+    size_t l = raster.skip;
+    while (l + 1 < raster.n_levels && raster.rsets[l].rx > res * (1 + PLAN_EPS))
+        l++;
+    const rset& level = raster.rsets[l];
+    plan.level = l - raster.skip;
+
+    // Pixel size of the level, last column and row might be partial
+    size_t scale = size_t(1) << (raster.n_levels - 1 - l);
+    size_t lw = (raster.size.x + scale - 1) / scale;
+    size_t lh = (raster.size.y + scale - 1) / scale;
+
+    // Level pixel coordinates of the bbox, clipped to the raster
+    double fx0 = (bbox.xmin - raster.bbox.xmin) / level.rx;
+    double fx1 = (bbox.xmax - raster.bbox.xmin) / level.rx;
+    double fy0 = (raster.bbox.ymax - bbox.ymax) / level.ry;
+    double fy1 = (raster.bbox.ymax - bbox.ymin) / level.ry;
+    if (fx1 <= PLAN_EPS || fy1 <= PLAN_EPS || fx0 >= lw - PLAN_EPS || fy0 >= lh - PLAN_EPS) {
+        plan.width = plan.height = 0;
+        plan.tx0 = plan.tx1 = plan.ty0 = plan.ty1 = 0;
+        plan.bbox = bbox;
+        return nullptr;
+    }
+
+    size_t px0 = static_cast<size_t>(max(0.0, floor(fx0 + PLAN_EPS)));
+    size_t py0 = static_cast<size_t>(max(0.0, floor(fy0 + PLAN_EPS)));
+    size_t px1 = min(lw, static_cast<size_t>(ceil(fx1 - PLAN_EPS)));
+    size_t py1 = min(lh, static_cast<size_t>(ceil(fy1 - PLAN_EPS)));
+
+    plan.width = px1 - px0;
+    plan.height = py1 - py0;
+    plan.bbox.xmin = raster.bbox.xmin + px0 * level.rx;
+    plan.bbox.xmax = raster.bbox.xmin + px1 * level.rx;
+    plan.bbox.ymax = raster.bbox.ymax - py0 * level.ry;
+    plan.bbox.ymin = raster.bbox.ymax - py1 * level.ry;
+
+    size_t tw = raster.pagesize.x, th = raster.pagesize.y;
+    plan.tx0 = px0 / tw;
+    plan.ty0 = py0 / th;
+    plan.tx1 = min(level.w, (px1 + tw - 1) / tw);
+    plan.ty1 = min(level.h, (py1 + th - 1) / th);
+
+    plan.tiles.reserve((plan.tx1 - plan.tx0) * (plan.ty1 - plan.ty0));
+    for (size_t ty = plan.ty0; ty < plan.ty1; ty++) {
+        size_t y0 = max(py0, ty * th), y1 = min(py1, (ty + 1) * th);
+        for (size_t tx = plan.tx0; tx < plan.tx1; tx++) {
+            size_t x0 = max(px0, tx * tw), x1 = min(px1, (tx + 1) * tw);
+            tile_window_t tile;
+            tile.tile = sloc_t();
+            tile.tile.l = plan.level;
+            tile.tile.x = tx;
+            tile.tile.y = ty;
+            tile.x = x0 - tx * tw;
+            tile.y = y0 - ty * th;
+            tile.w = x1 - x0;
+            tile.h = y1 - y0;
+            tile.ox = x0 - px0;
+            tile.oy = y0 - py0;
+            plan.tiles.push_back(tile);
+        }
+    }
+    return nullptr;
+}
+
 // Return the value from a base 32 character
 // Returns a negative value if char is not a valid base32 char
 // ASCII only
@@ -320,9 +400,7 @@ void tobase32(uint64_t value, char *buffer, int b65) {
 //
 char *readFile(apr_pool_t *pool, storage_manager &mgr, const char *line)
 {
-    apr_file_t *efile;
     apr_off_t offset = 0;
-    apr_status_t stat;
     char *last;
 
     mgr.size = static_cast<int>(apr_strtoi64(line, &last, 0));
@@ -333,30 +411,25 @@ char *readFile(apr_pool_t *pool, storage_manager &mgr, const char *line)
     while (*last && isblank(*last)) last++;
     const char *efname = last;
 
-    // Use the temp pool for the file open, it will close it for us
-    if (0 == mgr.size) { // Don't know the size, get it from the file
-        apr_finfo_t finfo;
-        stat = apr_stat(&finfo, efname, APR_FINFO_CSIZE, pool);
-        if (APR_SUCCESS != stat)
-            return apr_psprintf(pool, "Can't stat %s %pm", efname, &stat);
-        mgr.size = static_cast<int>(finfo.size);
-    }
+    apr_status_t stat;
+    cached_file_t *efile = acquire_file(efname, &stat);
+    if (!efile)
+        return apr_psprintf(pool, "Can't open empty file %s, %pm", efname, &stat);
+
+    if (0 == mgr.size) // Don't know the size, get it from the file
+        mgr.size = static_cast<int>(cached_file_size(efile));
 
     apr_size_t size = mgr.size;
-    if (size > MAX_READ_SIZE)
+    if (size > MAX_READ_SIZE) {
+        release_file(efile);
         return apr_psprintf(pool, "Empty tile too large, max is %d", MAX_READ_SIZE);
+    }
 
-    stat = apr_file_open(&efile, efname, READ_RIGHTS, 0, pool);
-    if (APR_SUCCESS != stat)
-        return apr_psprintf(pool, "Can't open empty file %s, %pm", efname, &stat);
     mgr.buffer = static_cast<char *>(apr_palloc(pool, size));
-    stat = apr_file_seek(efile, APR_SET, &offset);
-    if (APR_SUCCESS != stat)
-        return apr_psprintf(pool, "Can't seek empty tile %s: %pm", efname, &stat);
-    stat = apr_file_read(efile, mgr.buffer, &size);
-    if (APR_SUCCESS != stat || size != static_cast<apr_size_t>(mgr.size))
-        return apr_psprintf(pool, "Can't read from %s: %pm", efname, &stat);
-    apr_file_close(efile);
+    size = cached_pread(efile, offset, mgr.buffer, size);
+    release_file(efile);
+    if (size != static_cast<apr_size_t>(mgr.size))
+        return apr_psprintf(pool, "Can't read from %s", efname);
     return NULL;
 }
 
@@ -464,6 +537,7 @@ apr_status_t getMLRC(request_rec *r, sz5 &tile, int need_m) {
     tile.z = need_m ? apr_atoi64(ARRAY_POP(tokens, char *)) : 0;
     // Z defaults to 0
     if (errno) tile.z = 0;
+    hot_tile_record(r);
     return APR_SUCCESS;
 }
 
@@ -528,34 +602,6 @@ apr_hash_t *argparse(request_rec *r, const char *raw_args, const char *sep, bool
     return form;
  }
 
-// Mostly copied from mrf_util.cpp:ZUnPack()
-// return true if all is OK
-static int gunzip(const storage_manager& src, storage_manager& dst) {
-    z_stream stream;
-    memset(&stream, 0, sizeof(stream));
-    stream.next_in = reinterpret_cast<Bytef*>(src.buffer);
-    stream.avail_in = static_cast<uInt>(src.size);
-    stream.next_out = reinterpret_cast<Bytef*>(dst.buffer);
-    stream.avail_out = static_cast<uInt>(dst.size);
-
-    // Gzip, max window size
-    if (Z_OK != inflateInit2(&stream, 16 + MAX_WBITS))
-        return false;
-    auto err = inflate(&stream, Z_FINISH);
-
-    // Use dst.size as flag, that buffer was too small
-    if (Z_BUF_ERROR == err)
-        dst.size = -1; 
-
-    if (Z_STREAM_END != err) {
-        inflateEnd(&stream);
-        return false;
-    }
-
-    dst.size = stream.total_out;
-    return Z_OK == inflateEnd(&stream);
-}
-
 // DEBUG, log headers in debug mode, call with 
 // apr_table_do(phdr, r, header_table, NULL)
 //
@@ -574,57 +620,497 @@ static int gunzip(const storage_manager& src, storage_manager& dst) {
 //        tag.erase(tag.end() - 1);
 //}
 
-int subr::fetch(const char *url, storage_manager& dst) {
-    static ap_filter_rec_t* receive_filter = nullptr;
-    if (!receive_filter) {
-        receive_filter = ap_get_output_filter_handle("Receive");
-        if (!receive_filter)
-            return HTTP_INTERNAL_SERVER_ERROR; // Receive not found
+// Output filter context, the chain is reset when the first content arrives,
+// so it stays unchanged for responses without content, like 304
+struct chain_ctx {
+    chain_ctx(receive_chain& c) : chain(&c), started(false) {}
+    receive_chain* chain;
+    bool started;
+};
+
+// Output filter for subrequests, appends the content to a receive_chain
+// The content past the chain maxsize is consumed and dropped
+static apr_status_t chain_filter(ap_filter_t* f, apr_bucket_brigade* bb) {
+    auto ctx = static_cast<chain_ctx*>(f->ctx);
+    auto chain = ctx->chain;
+    for (apr_bucket* b = APR_BRIGADE_FIRST(bb); b != APR_BRIGADE_SENTINEL(bb);
+        b = APR_BUCKET_NEXT(b))
+    {
+        if (APR_BUCKET_IS_METADATA(b))
+            continue;
+        const char* data;
+        apr_size_t len;
+        apr_status_t stat = apr_bucket_read(b, &data, &len, APR_BLOCK_READ);
+        if (APR_SUCCESS != stat)
+            return stat;
+        if (!ctx->started) {
+            ctx->started = true;
+            chain->reset();
+        }
+        if (!chain->overflow)
+            chain->append(data, len);
+    }
+    apr_brigade_cleanup(bb);
+    return APR_SUCCESS;
+}
+
+// Owned by libahtse, it doesn't need to be registered
+static ap_filter_rec_t* chain_filter_handle() {
+    static ap_filter_rec_t frec;
+    static once_flag once;
+    call_once(once, [] {
+        memset(&frec, 0, sizeof(frec));
+        frec.name = "AHTSE_Receive_Chain";
+        frec.filter_func.out_func = chain_filter;
+        frec.ftype = AP_FTYPE_RESOURCE;
+    });
+    return &frec;
+}
+
+//
+// Single flight, concurrent fetches of the same key wait for the first one
+// and get a copy of its result
+//
+
+struct flight_t {
+    flight_t() : waiters(0), done(false), status(0), has_etag(false),
+        leader(this_thread::get_id()) {}
+    mutex lock;
+    condition_variable cv;
+    size_t waiters; // Protected by flights_lock
+    bool done;
+    // Result
+    int status;
+    vector<uint8_t> data;
+    bool has_etag;
+    string ETag;
+    string error_message;
+    thread::id leader;
+};
+
+static mutex flights_lock;
+static unordered_map<string, shared_ptr<flight_t>> flights;
+static atomic<int> coalescing(1);
+
+void set_fetch_coalescing(int on) {
+    coalescing = on;
+}
+
+// Result content, from a buffer or a chain
+static void flight_publish(flight_t& f, storage_manager& dst) {
+    const uint8_t* b = static_cast<const uint8_t*>(dst.buffer);
+    f.data.assign(b, b + dst.size);
+}
+
+static void flight_publish(flight_t& f, receive_chain& dst) {
+    f.data.resize(dst.size);
+    f.data.resize(dst.peek(0, f.data.data(), dst.size));
+}
+
+static apr_size_t flight_capacity(const storage_manager& dst) {
+    return dst.size;
+}
+
+static apr_size_t flight_capacity(const receive_chain& dst) {
+    return dst.maxsize;
+}
+
+// Copy of the result content, returns 413 if it doesn't fit
+static int flight_deliver(const flight_t& f, storage_manager& dst, int status) {
+    size_t size = min(dst.size, f.data.size());
+    if (size)
+        memcpy(dst.buffer, f.data.data(), size);
+    if (f.data.size() > dst.size)
+        return HTTP_REQUEST_ENTITY_TOO_LARGE; // Buffer is full
+    if (APR_SUCCESS == status)
+        dst.size = size;
+    return status;
+}
+
+static int flight_deliver(const flight_t& f, receive_chain& dst, int status) {
+    dst.reset();
+    if (!dst.append(f.data.data(), f.data.size()))
+        return HTTP_REQUEST_ENTITY_TOO_LARGE;
+    return status;
+}
+
+// Either runs fetch and shares the result, or waits for the same key already in flight
+// fetch writes into dst and the result fields of the flight
+// Returns the status, dst is updated as if fetch ran
+template<typename D, typename F> static int single_flight(const string& key, D& dst,
+    flight_t& result, F fetch)
+{
+    shared_ptr<flight_t> f;
+    bool leader = false;
+    if (coalescing) {
+        lock_guard<mutex> guard(flights_lock);
+        auto it = flights.find(key);
+        if (it == flights.end()) {
+            f = make_shared<flight_t>();
+            flights[key] = f;
+            leader = true;
+        }
+        else if (it->second->leader != this_thread::get_id()) {
+            f = it->second;
+            f->waiters++;
+        }
+        // Same key from the same thread is recursion, fetch without coalescing
+    }
+
+    if (!f)
+        return fetch(dst, result);
+
+    if (leader) {
+        int status = fetch(dst, result);
+        size_t waiters;
+        {
+            lock_guard<mutex> guard(flights_lock);
+            flights.erase(key);
+            waiters = f->waiters;
+        }
+        // Publish a copy only if someone is waiting
+        unique_lock<mutex> guard(f->lock);
+        if (waiters) {
+            f->status = status;
+            if (APR_SUCCESS == status || HTTP_REQUEST_ENTITY_TOO_LARGE == status)
+                flight_publish(*f, dst);
+            f->has_etag = result.has_etag;
+            f->ETag = result.ETag;
+            f->error_message = result.error_message;
+        }
+        f->done = true;
+        f->cv.notify_all();
+        return status;
+    }
+
+    unique_lock<mutex> guard(f->lock);
+    f->cv.wait(guard, [&f] { return f->done; });
+    // The leader buffer was too small, but this one might be large enough
+    if (HTTP_REQUEST_ENTITY_TOO_LARGE == f->status && flight_capacity(dst) > f->data.size()) {
+        guard.unlock();
+        return fetch(dst, result);
     }
+    result.has_etag = f->has_etag;
+    result.ETag = f->ETag;
+    result.error_message = f->error_message;
+    int status = f->status;
+    if (APR_SUCCESS == status || HTTP_REQUEST_ENTITY_TOO_LARGE == status)
+        status = flight_deliver(*f, dst, status);
+    return status;
+}
+
+// The server and user are part of the key, the same path may not be the same content
+static string flight_key(request_rec* r, const char* kind, const char* path) {
+    string key(kind);
+    key.append(" ").append(r->server->server_hostname ? r->server->server_hostname : "");
+    key.append(" ").append(r->user ? r->user : "");
+    key.append(" ").append(path);
+    return key;
+}
+
+// Issues a request through the circuit breaker of the url source
+// When the breaker fails the request right away, *shed is set
+template<typename F> static int guarded(request_rec* r, const char* url, F request,
+    bool* shed = nullptr)
+{
+    int probe;
+    int status = breaker_check(r, url, &probe);
+    if (shed)
+        *shed = (0 != status);
+    if (status)
+        return status;
+    apr_time_t start = apr_time_now();
+    status = request();
+    breaker_record(r, url, status, apr_time_now() - start, probe);
+    return status;
+}
+
+// Issues the request to each replica of url in turn, until one doesn't fail
+// The request is called with the replica url and a flag set after the first try
+template<typename F> static int failover(request_rec* r, const char* url, F request,
+    bool* shed = nullptr)
+{
+    vector<string> urls = replica_urls(url);
+    int status = APR_SUCCESS;
+    for (size_t i = 0; i < urls.size(); i++) {
+        const char* rurl = urls[i].c_str();
+        bool retry = (0 != i), sh;
+        apr_time_t start = apr_time_now();
+        status = guarded(r, rurl, [&]() { return request(rurl, retry); }, &sh);
+        if (shed)
+            *shed = sh;
+        if (urls.size() > 1 && !sh)
+            replica_record(rurl, 0 != source_failed(status), apr_time_now() - start);
+        if (!source_failed(status))
+            break;
+    }
+    return status;
+}
+
+// Disk cache key for a url, local paths depend on the virtual host
+static string cache_url(request_rec* r, const char* url) {
+    if (is_http_url(url))
+        return string(url);
+    string key(r->server->server_hostname ? r->server->server_hostname : "");
+    return key.append(url);
+}
+
+//
+// Validators of the files read by range, the disk cache entries are keyed by them
+// The validator of each file is kept in the disk cache index, shared by all processes.
+// Once stale it is confirmed with a one byte conditional request, so files which are
+// changed in place, like the MRF index, are read again
+//
+
+// Asks the source for the current validator, returns it or an empty string on failure
+static string rr_revalidate(request_rec* r, const char* url, const string& validator) {
+    // ETags are matched, dates are compared
+    bool etag = '"' == validator[0] || !validator.compare(0, 2, "W/");
+    const char* condition = etag ? "If-None-Match" : "If-Modified-Since";
+    const char* value = apr_pstrdup(r->pool, validator.c_str());
+    char byte;
+
+    if (is_http_url(url)) {
+        apr_table_t* headers = apr_table_make(r->pool, 2);
+        apr_table_setn(headers, "Range", "bytes=0-0");
+        apr_table_setn(headers, condition, value);
+        storage_manager body(&byte, 1);
+        http_result_t result;
+        if (APR_SUCCESS != http_get(url, body, result, headers))
+            return string();
+        if (HTTP_NOT_MODIFIED == result.status)
+            return validator;
+        if (HTTP_OK != result.status && HTTP_PARTIAL_CONTENT != result.status)
+            return string();
+        return result.ETag.empty() ? result.last_modified : result.ETag;
+    }
+
+    auto receive_filter = ap_get_output_filter_handle("Receive");
+    if (!receive_filter)
+        return string();
+    receive_ctx rctx;
+    memset(&rctx, 0, sizeof(rctx));
+    rctx.buffer = &byte;
+    rctx.maxsize = 1;
+    request_rec* sr = ap_sub_req_lookup_uri(url, r, r->output_filters);
+    apr_table_clear(sr->headers_in);
+    apr_table_setn(sr->headers_in, "Range", "bytes=0-0");
+    apr_table_setn(sr->headers_in, condition, value);
+    ap_filter_t* rf = ap_add_output_filter_handle(receive_filter, &rctx, sr, sr->connection);
+    int status = ap_run_sub_req(sr);
+    int sr_status = sr->status;
+    ap_remove_output_filter(rf);
+    const char* tag = apr_table_get(sr->headers_out, "ETag");
+    if (!tag)
+        tag = apr_table_get(sr->headers_out, "Last-Modified");
+    string current(tag ? tag : "");
+    ap_destroy_sub_req(sr);
 
+    if (HTTP_NOT_MODIFIED == sr_status)
+        return validator;
+    if (APR_SUCCESS != status || (HTTP_OK != sr_status && HTTP_PARTIAL_CONTENT != sr_status))
+        return string();
+    return current;
+}
+
+// Validator of a file, from the disk cache, checked with the source when stale
+static bool rr_validator(request_rec* r, const char* url, const string& curl, string& validator) {
+    bool stale = false;
+    if (APR_SUCCESS != disk_cache_get_validator(curl.c_str(), validator, &stale))
+        return false;
+    if (!stale)
+        return true;
+    validator = rr_revalidate(r, url, validator);
+    if (validator.empty())
+        return false;
+    disk_cache_put_validator(curl.c_str(), validator.c_str());
+    return true;
+}
+
+// Reads the range from the disk cache, into an empty chain
+int subr::disk_fetch(const char* url, const char* key, receive_chain& dst) {
+    if (dst.size || range.size > dst.maxsize)
+        return APR_NOTFOUND;
+    dst.expect(range.size);
+    apr_size_t len;
+    char* buffer = dst.reserve(len);
+    if (!buffer || len < range.size)
+        return APR_NOTFOUND;
+    storage_manager sm(buffer, range.size);
+    string tag;
+    if (!rr_validator(main, url, key, validator)
+        || APR_SUCCESS != disk_cache_get(key, range.offset, validator.c_str(), sm, &tag))
+        return APR_NOTFOUND;
+    dst.commit(range.size);
+    ETag = tag;
+    error_message.clear();
+    return APR_SUCCESS;
+}
+
+int subr::fetch(const char* url, storage_manager& dst) {
+    receive_chain chain(dst);
+    int status = fetch(url, chain);
+    if (APR_SUCCESS == status)
+        dst.size = chain.size;
+    return status;
+}
+
+int subr::fetch(const char* url, receive_chain& dst) {
+    string key = flight_key(main, "fetch", url);
+    key.append(" ").append(agent).append(" ").append(known_ETag);
+    if (range.valid)
+        key.append(apr_psprintf(main->pool, " %" APR_UINT64_T_FMT "-%" APR_UINT64_T_FMT,
+            range.offset, range.size));
+
+    // Ranges are cached on disk, keyed by the source validator, the ETag is kept with the data
+    bool cached = range.valid && known_ETag.empty();
+    string curl = cached ? cache_url(main, url) : string();
+    flight_t result;
+    int status = single_flight(key, dst, result,
+        [this, url, cached, &curl](receive_chain& d, flight_t& res) {
+            int status = cached ? disk_fetch(url, curl.c_str(), d) : APR_NOTFOUND;
+            if (APR_SUCCESS != status) {
+                bool shed;
+                status = failover(main, url, [this, &d](const char* u, bool retry) {
+                    if (retry)
+                        d.reset();
+                    return fetch_once(u, d);
+                }, &shed);
+                if (shed)
+                    error_message = "Source unavailable";
+                if (cached && APR_SUCCESS == status && d.size == range.size
+                    && !validator.empty()) {
+                    disk_cache_put_validator(curl.c_str(), validator.c_str());
+                    disk_cache_put(curl.c_str(), range.offset, validator.c_str(),
+                        d.contiguous(), ETag.c_str());
+                }
+            }
+            res.has_etag = true;
+            res.ETag = ETag;
+            res.error_message = error_message;
+            return status;
+        });
+    ETag = result.ETag;
+    error_message = result.error_message;
+    return status;
+}
+
+int subr::fetch_once(const char *url, receive_chain& dst) {
     int failed = false;
     char* srange = nullptr;
     if (range.valid) 
         srange = apr_psprintf(main->pool, "bytes=%" APR_UINT64_T_FMT "-%" APR_UINT64_T_FMT,
                     range.offset, range.size);
 
-    // Keep this outside of the loop, so we can capture rctx.maxsize
-    receive_ctx rctx;
     // For Etag capture
     uint64_t evalue = 0;
     int missing = 0;
     do {
-        rctx.buffer = static_cast<char *>(dst.buffer);
-        rctx.maxsize = static_cast<int>(dst.size);
-        rctx.size = 0;
-
-        request_rec* sr = ap_sub_req_lookup_uri(url, main, main->output_filters);
-        if (range.valid)
-            apr_table_setn(sr->headers_in, "Range", srange);
-        if (!agent.empty())
-            apr_table_setn(sr->headers_in, "User-Agent", agent.c_str());
-        ap_filter_t* rf = 
-            ap_add_output_filter_handle(receive_filter, &rctx, sr, sr->connection);
-        int status = ap_run_sub_req(sr);
-        int sr_status = sr->status;
-
-        // input ETag, if any, before destroying subrequest
-        const char *intag = apr_table_get(sr->headers_out, "ETag");
+        int status, sr_status;
+        const char* intag = nullptr;
+        const char* location = nullptr;
+        int overflow = 0;
+        if (is_http_url(url)) { // Direct, no subrequest
+            apr_table_t* headers = apr_table_make(main->pool, 3);
+            if (range.valid)
+                apr_table_setn(headers, "Range", srange);
+            if (!agent.empty())
+                apr_table_setn(headers, "User-Agent", agent.c_str());
+            if (!known_ETag.empty())
+                apr_table_setn(headers, "If-None-Match", known_ETag.c_str());
+            http_result_t result;
+            const char* msg = nullptr;
+            status = http_get(url, dst, result, headers, &msg);
+            sr_status = result.status;
+            overflow = result.overflow || dst.overflow;
+            if (APR_SUCCESS != status)
+                error_message = msg;
+            if (!result.ETag.empty())
+                intag = apr_pstrdup(main->pool, result.ETag.c_str());
+            validator = result.ETag.empty() ? result.last_modified : result.ETag;
+            if (sr_status == HTTP_MOVED_PERMANENTLY || sr_status == HTTP_MOVED_TEMPORARILY)
+                location = apr_pstrdup(main->pool, result.location.c_str());
+        }
+        else {
+            request_rec* sr = ap_sub_req_lookup_uri(url, main, main->output_filters);
+            // The client conditionals are not part of the coalescing key, only known_ETag is
+            for (auto name : { "If-None-Match", "If-Modified-Since", "If-Match",
+                "If-Unmodified-Since", "If-Range" })
+                apr_table_unset(sr->headers_in, name);
+            if (range.valid)
+                apr_table_setn(sr->headers_in, "Range", srange);
+            if (!agent.empty())
+                apr_table_setn(sr->headers_in, "User-Agent", agent.c_str());
+            if (!known_ETag.empty())
+                apr_table_setn(sr->headers_in, "If-None-Match", known_ETag.c_str());
+            chain_ctx ctx(dst);
+            ap_filter_t* rf =
+                ap_add_output_filter_handle(chain_filter_handle(), &ctx, sr, sr->connection);
+            status = ap_run_sub_req(sr);
+            sr_status = sr->status;
+            overflow = dst.overflow;
+            // No content
+            if (!ctx.started && HTTP_NOT_MODIFIED != status && HTTP_NOT_MODIFIED != sr_status)
+                dst.reset();
+
+            // input ETag, if any, before destroying subrequest
+            intag = apr_table_get(sr->headers_out, "ETag");
+            if (intag)
+                intag = apr_pstrdup(main->pool, intag);
+            const char* lm = apr_table_get(sr->headers_out, "Last-Modified");
+            validator = intag ? intag : (lm ? lm : "");
+            // Get a copy of the location header
+            if (sr_status == HTTP_MOVED_PERMANENTLY || sr_status == HTTP_MOVED_TEMPORARILY)
+                location = apr_pstrdup(main->pool, apr_table_get(sr->headers_out, "Location"));
+
+            ap_remove_output_filter(rf);
+            ap_destroy_sub_req(sr);
+        }
         if (intag)
             evalue = base32decode(intag, &missing);
-        const char* location = nullptr;
-        // Get a copy of the location header
-        if (sr_status == HTTP_MOVED_PERMANENTLY || sr_status == HTTP_MOVED_TEMPORARILY)
-            location = apr_pstrdup(main->pool, apr_table_get(sr->headers_out, "Location"));
 
-        ap_remove_output_filter(rf);
-        ap_destroy_sub_req(sr);
+        bool not_modified = HTTP_NOT_MODIFIED == status || HTTP_NOT_MODIFIED == sr_status;
+        // Not a conditional request, there is no content to use
+        if (not_modified && known_ETag.empty()) {
+            error_message = "Remote responds with 304";
+            failed = true;
+            break;
+        }
+
+        // Content didn't change, dst is left as it was
+        if (not_modified) {
+            if (!intag)
+                ETag = known_ETag;
+            else {
+                char etagsrc[14] = { 0 };
+                tobase32(evalue, etagsrc, missing);
+                ETag = etagsrc;
+            }
+            return HTTP_NOT_MODIFIED;
+        }
 
         if (APR_SUCCESS != status) {
             failed = true; // the request didn't work!
             break;
         }
 
+        // Truncated content is not a tile, retrying won't help
+        if (overflow && (HTTP_OK == sr_status || HTTP_PARTIAL_CONTENT == sr_status)) {
+            error_message = "Content too large";
+            return HTTP_REQUEST_ENTITY_TOO_LARGE;
+        }
+
+        // Direct requests follow absolute redirects as they are
+        if (location && is_http_url(url) && is_http_url(location)) {
+            if (0 == tries--) {
+                error_message = "Too many redirects";
+                failed = true;
+                break;
+            }
+            url = location;
+            continue;
+        }
+
         // Handle redirects, strip the protocol and host added by mod_proxy, keep only the path
         if (location && (location = strstr(location, "//")) && (location = strchr(location + 2, '/'))) {
             // counts as a retry, avoid infinite loops
@@ -645,11 +1131,9 @@ int subr::fetch(const char *url, storage_manager& dst) {
         }
 
         // exit condition, got what we need
-        if ((range.valid && static_cast<size_t>(rctx.size) == range.size) 
-            || (!range.valid && HTTP_OK == sr_status)) {
-            dst.size = rctx.size;
+        if ((range.valid && static_cast<size_t>(dst.size) == range.size)
+            || (!range.valid && HTTP_OK == sr_status))
             break;
-        }
 
         switch (sr_status) {
         case HTTP_OK:
@@ -670,47 +1154,82 @@ int subr::fetch(const char *url, storage_manager& dst) {
 
     // Build an etag from raw content, if it's large enough
     if (!evalue && dst.size > 128) {
-        evalue = *(reinterpret_cast<uint64_t*>(dst.buffer) + 4);
-        evalue |= *(reinterpret_cast<uint64_t*>(dst.buffer) + dst.size / 8 - 4);
-        evalue ^= *(reinterpret_cast<uint64_t*>(dst.buffer) + dst.size / 8 - 6);
+        uint64_t w[3] = { 0, 0, 0 };
+        dst.peek(4 * 8, &w[0], 8);
+        dst.peek((dst.size / 8 - 4) * 8, &w[1], 8);
+        dst.peek((dst.size / 8 - 6) * 8, &w[2], 8);
+        evalue = (w[0] | w[1]) ^ w[2];
     }
 
-
     char etagsrc[14] = { 0 };
     tobase32(evalue, etagsrc, missing);
     ETag = etagsrc;
 
-    uint32_t sig = 0;
-    if (!failed && static_cast<size_t>(dst.size) >= sizeof(sig))
-        memcpy(&sig, dst.buffer, sizeof(sig));
+    // The signature is enough to tell, the content is not flattened unless it gets unpacked
+    unsigned char head[4];
+    storage_manager sig(head, dst.peek(0, head, sizeof(head)));
+    zip_t zip = failed ? ZIP_NONE : zip_type(sig, unpack);
 
     // This needs to do an in-place unzip
-    if (GZIP_SIG == sig) { // !failed is implicit, so we can return
+    if (ZIP_NONE != zip) { // !failed is implicit, so we can return
+        storage_manager content = dst.contiguous();
         // Try using the reminder of the buffer
         storage_manager zipdest;
-        zipdest.buffer = static_cast<uint8_t *>(dst.buffer) + dst.size;
-        zipdest.size = static_cast<size_t>(rctx.maxsize) - dst.size;
+        void *scratch = nullptr;
+        bool too_small = false;
+        zipdest.buffer = static_cast<uint8_t *>(content.buffer) + content.size;
+        zipdest.size = dst.room;
 
-        if (!gunzip(dst, zipdest)) {
+        if (!zipdest.size || !unzip(zip, content, zipdest)) {
             // Maybe too large, allocate a new buffer, unpack there, then copy data back
             // the unpacked size still needs to be under the input dest buffer max size
-            if (dst.size < 0) { // Output buffer was too small
-                zipdest.size = rctx.maxsize;
-                zipdest.buffer = reinterpret_cast<char*>(apr_palloc(main->pool, zipdest.size));
-                failed = !gunzip(dst, zipdest);
-                if (failed)
-                    error_message = "Uncompressed output buffer too small";
+            if (!zipdest.size || zipdest.size == static_cast<size_t>(-1)) { // Output buffer was too small
+                // gzip stores the size, modulo 4GB, otherwise start from a few times the input
+                apr_size_t size = 4 * content.size;
+                apr_uint32_t isize = 0;
+                if (ZIP_GZIP == zip && content.size > 18) {
+                    const uint8_t* t = static_cast<const uint8_t*>(content.buffer) + content.size - 4;
+                    isize = t[0] | (t[1] << 8) | (t[2] << 16) | (static_cast<apr_uint32_t>(t[3]) << 24);
+                }
+                if (isize)
+                    size = isize;
+                for (;;) {
+                    zipdest.size = min<apr_size_t>(max<apr_size_t>(size, 1), dst.maxsize);
+                    // Scratch buffer, from the tile buffer cache
+                    scratch = get_tile_buffer(main->pool, zipdest.size);
+                    zipdest.buffer = scratch;
+                    failed = !scratch || !unzip(zip, content, zipdest);
+                    // Grows until the unpacked content fits or is too large
+                    if (!failed || !scratch || zipdest.size != static_cast<size_t>(-1)
+                        || size >= dst.maxsize)
+                        break;
+                    release_tile_buffer(main->pool, scratch);
+                    scratch = nullptr;
+                    size *= 2;
+                }
+                too_small = failed && (!scratch || zipdest.size == static_cast<size_t>(-1));
             }
-            else { // Some other unzip error
-                error_message = "gunzip error";
+            else // Some other unzip error
                 failed = true;
-            }
+            if (too_small)
+                error_message = "Uncompressed output buffer too small";
+            else if (failed)
+                error_message = (ZIP_GZIP == zip) ? "gunzip error"
+                    : (ZIP_ZSTD == zip) ? "zstd error" : "inflate error";
         }
 
         if (!failed) {
-            memmove(dst.buffer, zipdest.buffer, zipdest.size);
-            dst.size = zipdest.size;
+            if (scratch) {
+                dst.reset();
+                dst.append(zipdest.buffer, zipdest.size);
+            }
+            else { // Unpacked in the same segment, after the content
+                memmove(content.buffer, zipdest.buffer, zipdest.size);
+                dst.reset();
+                dst.commit(zipdest.size);
+            }
         }
+        release_tile_buffer(main->pool, scratch);
     }
 
     return failed ? HTTP_NOT_FOUND : APR_SUCCESS;
@@ -728,9 +1247,90 @@ DLL_PUBLIC char* tile_url(apr_pool_t* p, const char* src, sz5 tile, const char*
 }
 
 // Issues a subrequest and captures the response and the ETag
-int get_response(request_rec *r, const char *lcl_path, storage_manager &dst,
-    char **psETag)
+// get_response for http:// paths, into a chain
+static int http_response(request_rec *r, const char *url, receive_chain &dst,
+    char **psETag, const char *known_ETag)
 {
+    apr_table_t *headers = apr_table_make(r->pool, 1);
+    if (known_ETag)
+        apr_table_setn(headers, "If-None-Match", known_ETag);
+    http_result_t result;
+    if (APR_SUCCESS != http_get(url, dst, result, headers))
+        return HTTP_BAD_GATEWAY;
+
+    int status = result.status;
+    if (psETag && (status == HTTP_MOVED_PERMANENTLY || status == HTTP_MOVED_TEMPORARILY)
+        && !result.location.empty())
+        *psETag = apr_pstrdup(r->pool, result.location.c_str());
+    else if (psETag && !result.ETag.empty())
+        *psETag = apr_pstrdup(r->pool, result.ETag.c_str());
+
+    if (result.overflow)
+        return HTTP_REQUEST_ENTITY_TOO_LARGE;
+    return HTTP_OK == status ? APR_SUCCESS : status;
+}
+
+// get_response for http:// paths, with the direct client
+static int http_response(request_rec *r, const char *url, storage_manager &dst,
+    char **psETag, const char *known_ETag)
+{
+    receive_chain chain(dst);
+    int status = http_response(r, url, chain, psETag, known_ETag);
+    if (HTTP_NOT_MODIFIED != status && HTTP_REQUEST_ENTITY_TOO_LARGE != status)
+        dst.size = chain.size;
+    return status;
+}
+
+// range_read for http:// URLs, with the direct client
+static apr_size_t http_range_read(request_rec *r, const char *url, apr_off_t offset,
+    storage_manager &dst, int tries, const char **msg, string *validator)
+{
+    apr_table_t *headers = apr_table_make(r->pool, 1);
+    apr_table_setn(headers, "Range", apr_psprintf(r->pool,
+        "bytes=%" APR_UINT64_T_FMT "-%" APR_UINT64_T_FMT,
+        static_cast<apr_uint64_t>(offset), static_cast<apr_uint64_t>(offset + dst.size - 1)));
+
+    // S3 may return less than requested, so we retry the request a couple of times
+    for (;;) {
+        storage_manager body(dst.buffer, dst.size);
+        http_result_t result;
+        if (APR_SUCCESS != http_get(url, body, result, headers, msg))
+            return 0;
+        if (HTTP_OK == result.status && 0 != offset) {
+            if (msg)
+                *msg = "Remote doesn't support range requests";
+            return 0;
+        }
+        if (HTTP_PARTIAL_CONTENT != result.status && HTTP_OK != result.status) {
+            if (msg)
+                // Do not modify this message, it might get parsed back by the caller
+                *msg = apr_psprintf(r->pool, "Remote responds with %d", result.status);
+            return 0;
+        }
+        if (body.size == dst.size) {
+            *validator = result.ETag.empty() ? result.last_modified : result.ETag;
+            return result.total;
+        }
+        // Short because the file ends, retrying won't help
+        apr_size_t end = static_cast<apr_size_t>(offset + body.size);
+        if ((HTTP_OK == result.status && !result.overflow) || end == result.total) {
+            *validator = result.ETag.empty() ? result.last_modified : result.ETag;
+            return end;
+        }
+        if (0 == tries--) {
+            if (msg)
+                *msg = "Retries exhausted";
+            return 0;
+        }
+    }
+}
+
+static int get_response_once(request_rec *r, const char *lcl_path, storage_manager &dst,
+    char **psETag, const char *known_ETag)
+{
+    if (is_http_url(lcl_path))
+        return http_response(r, lcl_path, dst, psETag, known_ETag);
+
     static ap_filter_rec_t *receive_filter = nullptr;
     if (!receive_filter) {
         receive_filter = ap_get_output_filter_handle("Receive");
@@ -740,6 +1340,8 @@ int get_response(request_rec *r, const char *lcl_path, storage_manager &dst,
 
     request_rec *sr = ap_sub_req_lookup_uri(lcl_path, r, r->output_filters);
     apr_table_clear(sr->headers_in); // Sanitize input headers
+    if (known_ETag)
+        apr_table_setn(sr->headers_in, "If-None-Match", known_ETag);
     // if status is not 200 here, no point in going further
     if (sr->status != HTTP_OK)
         return sr->status;
@@ -760,8 +1362,8 @@ int get_response(request_rec *r, const char *lcl_path, storage_manager &dst,
     if (OK != code)
         status = code;
 
-    // Only return the size if we didn't overflow
-    if (!rctx.overflow)
+    // Only return the size if we didn't overflow, and not for not modified
+    if (!rctx.overflow && HTTP_NOT_MODIFIED != status)
         dst.size = rctx.size;
     const char *sETag = apr_table_get(sr->headers_out, "ETag");
     // If we have a location return a copy in the ETag pointer
@@ -781,6 +1383,318 @@ int get_response(request_rec *r, const char *lcl_path, storage_manager &dst,
     return 200 == status ? APR_SUCCESS: status;  // returns APR_SUCCESS or http code
 }
 
+// Same as get_response_once, into a chain, without mod_receive
+static int get_response_once(request_rec *r, const char *lcl_path, receive_chain &dst,
+    char **psETag, const char *known_ETag)
+{
+    if (is_http_url(lcl_path))
+        return http_response(r, lcl_path, dst, psETag, known_ETag);
+
+    request_rec *sr = ap_sub_req_lookup_uri(lcl_path, r, r->output_filters);
+    apr_table_clear(sr->headers_in); // Sanitize input headers
+    if (known_ETag)
+        apr_table_setn(sr->headers_in, "If-None-Match", known_ETag);
+    // if status is not 200 here, no point in going further
+    if (sr->status != HTTP_OK) {
+        int status = sr->status;
+        ap_destroy_sub_req(sr);
+        return status;
+    }
+
+    chain_ctx ctx(dst);
+    ap_filter_t *rf = ap_add_output_filter_handle(chain_filter_handle(), &ctx,
+        sr, sr->connection);
+    auto code = ap_run_sub_req(sr);
+    auto status = sr->status;
+    auto location = apr_table_get(sr->headers_out, "Location");
+    if (OK != code)
+        status = code;
+    if (!ctx.started && HTTP_NOT_MODIFIED != status)
+        dst.reset();
+
+    const char *sETag = apr_table_get(sr->headers_out, "ETag");
+    if (psETag && (status == HTTP_MOVED_PERMANENTLY|| status == HTTP_MOVED_TEMPORARILY)
+        && location)
+        *psETag = apr_pstrdup(r->pool, location);
+    else if (psETag && sETag)
+        *psETag = apr_pstrdup(r->pool, sETag);
+    ap_remove_output_filter(rf);
+    ap_destroy_sub_req(sr);
+
+    if (dst.overflow)
+        return HTTP_REQUEST_ENTITY_TOO_LARGE;
+    return 200 == status ? APR_SUCCESS : status;
+}
+
+// Keeps the ETag index current, a missing tile drops the entry
+static void record_etag(request_rec *r, const char *lcl_path, int status,
+    const flight_t& result, const char *known_ETag)
+{
+    if ((APR_SUCCESS == status || HTTP_NOT_MODIFIED == status) && result.has_etag)
+        etag_index_put(r, lcl_path, result.ETag.c_str());
+    else if (HTTP_NOT_MODIFIED == status && known_ETag)
+        etag_index_put(r, lcl_path, known_ETag);
+    else if (HTTP_NOT_FOUND == status)
+        etag_index_put(r, lcl_path, nullptr);
+}
+
+int get_response(request_rec *r, const char *lcl_path, storage_manager &dst,
+    char **psETag, const char *known_ETag)
+{
+    flight_t result;
+    string key = flight_key(r, "response", lcl_path);
+    if (known_ETag)
+        key.append(" ").append(known_ETag);
+    int status = single_flight(key, dst, result,
+        [r, lcl_path, known_ETag](storage_manager& d, flight_t& res) {
+            char* ETag = nullptr;
+            apr_size_t size = d.size;
+            int status = failover(r, lcl_path, [r, &d, &ETag, known_ETag, size](const char* u,
+                bool retry) {
+                if (retry)
+                    d.size = size;
+                return get_response_once(r, u, d, &ETag, known_ETag);
+            });
+            res.has_etag = (nullptr != ETag);
+            if (ETag)
+                res.ETag = ETag;
+            return status;
+        });
+    if (psETag && result.has_etag)
+        *psETag = apr_pstrdup(r->pool, result.ETag.c_str());
+    else if (psETag && HTTP_NOT_MODIFIED == status)
+        *psETag = apr_pstrdup(r->pool, known_ETag);
+    record_etag(r, lcl_path, status, result, known_ETag);
+    return status;
+}
+
+int get_response(request_rec *r, const char *lcl_path, receive_chain &dst,
+    char **psETag, const char *known_ETag)
+{
+    flight_t result;
+    string key = flight_key(r, "response", lcl_path);
+    if (known_ETag)
+        key.append(" ").append(known_ETag);
+    int status = single_flight(key, dst, result,
+        [r, lcl_path, known_ETag](receive_chain& d, flight_t& res) {
+            char* ETag = nullptr;
+            int status = failover(r, lcl_path, [r, &d, &ETag, known_ETag](const char* u,
+                bool retry) {
+                if (retry)
+                    d.reset();
+                return get_response_once(r, u, d, &ETag, known_ETag);
+            });
+            res.has_etag = (nullptr != ETag);
+            if (ETag)
+                res.ETag = ETag;
+            return status;
+        });
+    if (psETag && result.has_etag)
+        *psETag = apr_pstrdup(r->pool, result.ETag.c_str());
+    else if (psETag && HTTP_NOT_MODIFIED == status)
+        *psETag = apr_pstrdup(r->pool, known_ETag);
+    record_etag(r, lcl_path, status, result, known_ETag);
+    return status;
+}
+
+//
+// Streaming pass-through, the content goes to the client as it arrives
+//
+
+// Segment size for streaming from http:// sources
+#define STREAM_SEGMENT (64 * 1024)
+
+struct stream_ctx {
+    stream_ctx(request_rec* r, apr_size_t max_size) : r(r), max_size(max_size), size(0),
+        status(0), started(false), aborted(false) {}
+    request_rec* r; // The main request
+    apr_size_t max_size, size;
+    int status; // Source status, when the content is not passed on
+    bool started, aborted;
+    string ETag;
+};
+
+// Called before the first content, returns false if the content should not be passed on
+static bool stream_start(stream_ctx& ctx, int status, const char* ETag, const char* type,
+    apr_int64_t length)
+{
+    if (HTTP_OK != status || (length > 0 && static_cast<apr_uint64_t>(length) > ctx.max_size)) {
+        ctx.status = (HTTP_OK == status) ? HTTP_REQUEST_ENTITY_TOO_LARGE : status;
+        return false;
+    }
+    request_rec* r = ctx.r;
+    if (ETag) {
+        ctx.ETag = ETag;
+        apr_table_set(r->headers_out, "ETag", ETag);
+    }
+    if (type)
+        ap_set_content_type(r, apr_pstrdup(r->pool, type));
+    if (length >= 0)
+        ap_set_content_length(r, length);
+    ctx.started = true;
+    return true;
+}
+
+// Validators and caching headers of a direct response are passed on as they are
+static void stream_headers(stream_ctx& ctx, const http_result_t& result) {
+    const pair<const char*, const string*> headers[] = {
+        make_pair("Last-Modified", &result.last_modified),
+        make_pair("Cache-Control", &result.cache_control),
+        make_pair("Expires", &result.expires),
+        make_pair("Content-Encoding", &result.content_encoding)
+    };
+    for (auto& h : headers)
+        if (!h.second->empty())
+            apr_table_set(ctx.r->headers_out, h.first, h.second->c_str());
+}
+
+// Cuts a response in progress short, the client sees an incomplete response
+static void stream_abort(stream_ctx& ctx) {
+    request_rec* r = ctx.r;
+    ctx.aborted = true;
+    r->connection->keepalive = AP_CONN_CLOSE;
+    apr_bucket_brigade* bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    APR_BRIGADE_INSERT_TAIL(bb, ap_bucket_error_create(HTTP_BAD_GATEWAY, nullptr,
+        r->pool, r->connection->bucket_alloc));
+    ap_pass_brigade(r->output_filters, bb);
+}
+
+// Output filter for streaming subrequests, the next filter belongs to the main request
+static apr_status_t stream_filter(ap_filter_t* f, apr_bucket_brigade* bb) {
+    auto ctx = static_cast<stream_ctx*>(f->ctx);
+    request_rec* sr = f->r;
+    if (!ctx->started && !ctx->status) {
+        const char* length = apr_table_get(sr->headers_out, "Content-Length");
+        stream_start(*ctx, sr->status, apr_table_get(sr->headers_out, "ETag"),
+            sr->content_type, length ? apr_atoi64(length) : -1);
+        if (ctx->started) {
+            // Validators and caching headers are passed on as they are
+            static const char* names[] = { "Last-Modified", "Cache-Control", "Expires",
+                "Content-Encoding" };
+            for (auto name : names) {
+                const char* value = apr_table_get(sr->headers_out, name);
+                if (value)
+                    apr_table_set(ctx->r->headers_out, name, value);
+            }
+        }
+    }
+    if (!ctx->started || ctx->aborted) {
+        apr_brigade_cleanup(bb);
+        return APR_SUCCESS;
+    }
+
+    apr_off_t len = 0;
+    apr_status_t stat = apr_brigade_length(bb, 1, &len);
+    if (APR_SUCCESS != stat)
+        return stat;
+    ctx->size += static_cast<apr_size_t>(len);
+    if (ctx->size > ctx->max_size) {
+        apr_brigade_cleanup(bb);
+        stream_abort(*ctx);
+        return APR_SUCCESS;
+    }
+    return ap_pass_brigade(f->next, bb);
+}
+
+static ap_filter_rec_t* stream_filter_handle() {
+    static ap_filter_rec_t frec;
+    static once_flag once;
+    call_once(once, [] {
+        memset(&frec, 0, sizeof(frec));
+        frec.name = "AHTSE_Stream";
+        frec.filter_func.out_func = stream_filter;
+        frec.ftype = AP_FTYPE_RESOURCE;
+    });
+    return &frec;
+}
+
+// Streams from one source, returns OK once the content started, otherwise the source status
+static int stream_once(request_rec* r, const char* url, stream_ctx& ctx, const char* known_ETag) {
+    ctx.status = 0;
+    if (is_http_url(url)) {
+        apr_table_t* headers = apr_table_make(r->pool, 1);
+        if (known_ETag)
+            apr_table_setn(headers, "If-None-Match", known_ETag);
+        http_result_t result;
+        receive_chain chain(r->pool, min<apr_size_t>(STREAM_SEGMENT, ctx.max_size), ctx.max_size);
+        chain.sink = [&ctx, &result](const char* data, apr_size_t len) {
+            if (!ctx.started) {
+                if (!stream_start(ctx, result.status,
+                    result.ETag.empty() ? nullptr : result.ETag.c_str(),
+                    result.content_type.empty() ? nullptr : result.content_type.c_str(),
+                    result.length))
+                    return false;
+                stream_headers(ctx, result);
+            }
+            ctx.size += len;
+            return len == static_cast<apr_size_t>(ap_rwrite(data, static_cast<int>(len), ctx.r));
+        };
+        apr_status_t stat = http_get(url, chain, result, headers);
+        if (ctx.started) {
+            if (APR_SUCCESS != stat || result.overflow)
+                stream_abort(ctx);
+            return OK;
+        }
+        if (APR_SUCCESS != stat)
+            return HTTP_BAD_GATEWAY;
+        if (!result.ETag.empty())
+            ctx.ETag = result.ETag;
+        if (ctx.status)
+            return ctx.status;
+        // A response without content
+        if (HTTP_OK == result.status && stream_start(ctx, result.status,
+            ctx.ETag.empty() ? nullptr : ctx.ETag.c_str(), nullptr, 0))
+            stream_headers(ctx, result);
+        return ctx.started ? OK : result.status;
+    }
+
+    request_rec* sr = ap_sub_req_lookup_uri(url, r, r->output_filters);
+    apr_table_clear(sr->headers_in); // Sanitize input headers
+    if (known_ETag)
+        apr_table_setn(sr->headers_in, "If-None-Match", known_ETag);
+    if (sr->status != HTTP_OK) {
+        int status = sr->status;
+        ap_destroy_sub_req(sr);
+        return status;
+    }
+
+    ap_filter_t* sf = ap_add_output_filter_handle(stream_filter_handle(), &ctx,
+        sr, sr->connection);
+    auto code = ap_run_sub_req(sr);
+    int status = (OK != code) ? code : sr->status;
+    const char* sETag = apr_table_get(sr->headers_out, "ETag");
+    if (!ctx.started && sETag)
+        ctx.ETag = sETag;
+    if (!ctx.started && HTTP_OK == status)
+        stream_start(ctx, status, sETag, sr->content_type, 0);
+    ap_remove_output_filter(sf);
+    ap_destroy_sub_req(sr);
+    return ctx.started ? OK : status;
+}
+
+int stream_response(request_rec* r, const char* lcl_path, apr_size_t max_size,
+    const char** msg)
+{
+    stream_ctx ctx(r, max_size);
+    const char* known_ETag = apr_table_get(r->headers_in, "If-None-Match");
+    // Failover and retries are only possible until the content starts
+    int status = failover(r, lcl_path, [r, &ctx, known_ETag](const char* u, bool) {
+        return stream_once(r, u, ctx, known_ETag);
+    });
+
+    if (HTTP_NOT_MODIFIED == status && !ctx.ETag.empty())
+        apr_table_set(r->headers_out, "ETag", ctx.ETag.c_str());
+    if ((OK == status || HTTP_NOT_MODIFIED == status) && !ctx.ETag.empty())
+        etag_index_put(r, lcl_path, ctx.ETag.c_str());
+    else if (HTTP_NOT_FOUND == status)
+        etag_index_put(r, lcl_path, nullptr);
+    if (msg && ctx.aborted)
+        *msg = "Response larger than the maximum size or source error, aborted";
+    else if (msg && HTTP_REQUEST_ENTITY_TOO_LARGE == status)
+        *msg = "Response larger than the maximum size";
+    return status;
+}
+
 // Builds an MLRC uri, suffix optional
 char *pMLRC(apr_pool_t *pool, const char *prefix, const sloc_t &tile, const char *suffix) {
 #define FMT APR_INT64_T_FMT
@@ -792,9 +1706,11 @@ char *pMLRC(apr_pool_t *pool, const char *prefix, const sloc_t &tile, const char
     return apr_pstrcat(pool, prefix, "/tile", stile, suffix, NULL);
 }
 
-apr_size_t range_read(request_rec *r, const char *url, apr_off_t offset,
-    storage_manager &dst, int tries, const char **msg)
+// range_read with a subrequest
+static apr_size_t subr_range_read(request_rec *r, const char *url, apr_off_t offset,
+    storage_manager &dst, int tries, const char **msg, string *validator)
 {
+
     // Could this be static?
     auto receive_filter = ap_get_output_filter_handle("Receive");
     if (!receive_filter) {
@@ -813,7 +1729,7 @@ apr_size_t range_read(request_rec *r, const char *url, apr_off_t offset,
         offset, offset + dst.size);
 
     // S3 may return less than requested, so we retry the request a couple of times
-    bool failed = false;
+    bool failed = false, eof = false;
     apr_size_t size = 0;
     do {
         request_rec *sr = ap_sub_req_lookup_uri(url, r, r->output_filters);
@@ -829,13 +1745,20 @@ apr_size_t range_read(request_rec *r, const char *url, apr_off_t offset,
         if (content_range)
             if (1 != sscanf(content_range, "bytes %*d-%*d/%" APR_SIZE_T_FMT, &size))
                 size = 0;
+        const char* tag = apr_table_get(sr->headers_out, "ETag");
+        if (!tag)
+            tag = apr_table_get(sr->headers_out, "Last-Modified");
+        validator->assign(tag ? tag : "");
         ap_destroy_sub_req(sr);
 
         failed = !(APR_SUCCESS == status);
         if (!failed) {
+            // Short because the file ends, retrying won't help
+            eof = rctx.size < static_cast<int>(dst.size) && ((HTTP_OK == sr_status && !rctx.overflow)
+                || offset + rctx.size == static_cast<apr_off_t>(size));
             switch (sr_status) {
             case HTTP_PARTIAL_CONTENT:
-                if (0 == tries--) {
+                if (!eof && 0 == tries--) {
                     if (msg)
                         *msg = "Retries exhausted";
                     failed = true;
@@ -850,9 +1773,62 @@ apr_size_t range_read(request_rec *r, const char *url, apr_off_t offset,
                 failed = true;
             }
         }
-    } while (!failed && rctx.size != static_cast<int>(dst.size));
+    } while (!failed && !eof && rctx.size != static_cast<int>(dst.size));
 
-    return failed ? 0 : size;
+    if (failed)
+        return 0;
+    return eof ? static_cast<apr_size_t>(offset + rctx.size) : size;
+}
+
+apr_size_t range_read(request_rec *r, const char *url, apr_off_t offset,
+    storage_manager &dst, int tries, const char **msg)
+{
+    string curl = cache_url(r, url);
+    string validator;
+    apr_uint64_t total = 0;
+    if (rr_validator(r, url, curl, validator)
+        && APR_SUCCESS == disk_cache_get(curl.c_str(), offset, validator.c_str(), dst,
+            nullptr, &total))
+        return static_cast<apr_size_t>(total);
+
+    const char* message = nullptr;
+    apr_size_t size = 0;
+    bool shed = false;
+    int status = DECLINED;
+
+    // Replicas which are all http:// can be read with hedged requests
+    vector<string> urls = replica_urls(url);
+    bool direct = urls.size() > 1;
+    for (auto& u : urls)
+        direct = direct && is_http_url(u.c_str());
+    if (direct)
+        status = hedged_range_read(r, urls, offset, dst, &size, &validator);
+
+    // The status comes back in the message, when there is one
+    if (DECLINED == status)
+        status = failover(r, url, [&](const char* u, bool) {
+            size = is_http_url(u) ? http_range_read(r, u, offset, dst, tries, &message, &validator)
+                : subr_range_read(r, u, offset, dst, tries, &message, &validator);
+            int status = HTTP_BAD_GATEWAY;
+            if (size)
+                status = APR_SUCCESS;
+            else if (message)
+                sscanf(message, "Remote responds with %d", &status);
+            return status;
+        }, &shed);
+    else if (!size) // Past the end of the file is not a failure of the replicas
+        message = HTTP_RANGE_NOT_SATISFIABLE == status ?
+            apr_psprintf(r->pool, "Remote responds with %d", status) : "Replicas failed";
+    // Only content with a validator is cached
+    if (size && !validator.empty()) {
+        disk_cache_put_validator(curl.c_str(), validator.c_str());
+        disk_cache_put(curl.c_str(), offset, validator.c_str(), dst, nullptr, size);
+    }
+    if (shed) // Same format as a remote error
+        message = apr_psprintf(r->pool, "Remote responds with %d", status);
+    if (msg)
+        *msg = message;
+    return size;
 }
 
 NS_AHTSE_END
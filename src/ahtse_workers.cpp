@@ -0,0 +1,142 @@
+/*
+* ahtse_workers.cpp
+*
+* Process wide pool of worker threads, for CPU bound work such as decoding
+*
+* Threads are started on first use, so none exist before the server forks, and never exit.
+* The calling thread also works on its own batch, so a batch always completes even if all
+* the workers are busy, including when parallel_for is called from a worker
+*
+* (C) Lucian Plesea 2019-2021
+*
+*/
+
+#include "ahtse_common.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+
+using namespace std;
+NS_ICD_USE
+
+NS_AHTSE_START
+
+#define WP_MAX_THREADS 64
+
+struct wp_t {
+    wp_t() : started(0), idle(0) {}
+    mutex lock;
+    condition_variable cv;
+    deque<function<void()>> queue;
+    size_t started, idle;
+};
+
+// Never destroyed, the workers still wait on it when the process exits
+static wp_t& wp() {
+    static wp_t* pool = new wp_t;
+    return *pool;
+}
+
+static atomic<size_t> wp_threads(0);
+
+static void worker() {
+    wp_t& pool = wp();
+    for (;;) {
+        function<void()> job;
+        {
+            unique_lock<mutex> lock(pool.lock);
+            pool.idle++;
+            pool.cv.wait(lock, [&pool]() { return !pool.queue.empty(); });
+            pool.idle--;
+            job = move(pool.queue.front());
+            pool.queue.pop_front();
+        }
+        job();
+    }
+}
+
+// Number of threads, defaults to the number of cores
+static size_t pool_size() {
+    size_t n = wp_threads;
+    if (0 == n)
+        n = thread::hardware_concurrency();
+    return min<size_t>(max<size_t>(n, 1), WP_MAX_THREADS);
+}
+
+void set_worker_threads(size_t n) {
+    wp_threads = n;
+}
+
+struct batch_t {
+    batch_t(size_t n) : n(n), next(0), done(0) {}
+    size_t n;
+    atomic<size_t> next, done;
+    mutex lock;
+    condition_variable cv;
+};
+
+// Takes items from the batch until there are none left
+static void run_batch(const shared_ptr<batch_t>& b, const function<void(size_t)>* f) {
+    size_t i;
+    while ((i = b->next++) < b->n) {
+        (*f)(i);
+        if (++b->done == b->n) {
+            lock_guard<mutex> guard(b->lock);
+            b->cv.notify_all();
+        }
+    }
+}
+
+// Starts the threads up to the pool size, call with the queue lock held
+static void start_workers(wp_t& pool) {
+    while (pool.started < pool_size()) {
+        thread(worker).detach();
+        pool.started++;
+    }
+}
+
+void worker_submit(function<void()> job) {
+    wp_t& pool = wp();
+    {
+        lock_guard<mutex> guard(pool.lock);
+        start_workers(pool);
+        // These jobs might block, they don't wait for a busy thread
+        if (pool.idle <= pool.queue.size() && pool.started < WP_MAX_THREADS) {
+            thread(worker).detach();
+            pool.started++;
+        }
+        pool.queue.push_back(move(job));
+    }
+    pool.cv.notify_one();
+}
+
+void parallel_for(size_t n, const function<void(size_t)>& f) {
+    size_t helpers = min(n, pool_size()) - (n ? 1 : 0);
+    if (0 == helpers) {
+        for (size_t i = 0; i < n; i++)
+            f(i);
+        return;
+    }
+
+    auto b = make_shared<batch_t>(n);
+    // f is only used while items are left, which is before this function returns
+    const function<void(size_t)>* pf = &f;
+    wp_t& pool = wp();
+    {
+        lock_guard<mutex> guard(pool.lock);
+        start_workers(pool);
+        for (size_t i = 0; i < helpers; i++)
+            pool.queue.push_back([b, pf]() { run_batch(b, pf); });
+    }
+    pool.cv.notify_all();
+
+    run_batch(b, pf);
+    unique_lock<mutex> lock(b->lock);
+    b->cv.wait(lock, [&b]() { return b->done == b->n; });
+}
+
+NS_AHTSE_END
@@ -0,0 +1,156 @@
+/*
+* ahtse_zip.cpp
+*
+* One shot decompression of source content, gzip, zlib, raw deflate and zstd
+*
+* zlib is always available. With HAVE_LIBDEFLATE the deflate formats are decoded by
+* libdeflate, which is considerably faster for whole buffers. zstd needs HAVE_ZSTD
+* The decompression contexts are kept per thread, they are reused
+*
+* (C) Lucian Plesea 2019-2021
+*
+*/
+
+#include "ahtse_common.h"
+#include <cstring>
+#include <memory>
+#include <zlib.h>
+
+#if defined(HAVE_LIBDEFLATE)
+#include <libdeflate.h>
+#endif
+
+#if defined(HAVE_ZSTD)
+#include <zstd.h>
+#include <zstd_errors.h>
+#endif
+
+using namespace std;
+NS_ICD_USE
+
+NS_AHTSE_START
+
+// First four bytes, as a little endian number
+#define ZIP_GZIP_SIG 0x08088b1f
+#if defined(HAVE_ZSTD)
+#define ZIP_ZSTD_SIG 0xfd2fb528
+#endif
+
+zip_t zip_type(const storage_manager& src, zip_t assumed) {
+    if (src.size < 4)
+        return ZIP_NONE;
+    const unsigned char* p = static_cast<const unsigned char*>(src.buffer);
+    uint32_t sig = p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+    if (ZIP_GZIP_SIG == sig)
+        return ZIP_GZIP;
+#if defined(HAVE_ZSTD)
+    if (ZIP_ZSTD_SIG == sig)
+        return ZIP_ZSTD;
+#else
+    // Can't be decoded, the content is passed as is
+    if (ZIP_ZSTD == assumed)
+        return ZIP_NONE;
+#endif
+    return assumed;
+}
+
+#if defined(HAVE_LIBDEFLATE)
+
+struct deflate_free {
+    void operator()(libdeflate_decompressor* d) const { libdeflate_free_decompressor(d); }
+};
+
+static bool inflate_buffer(zip_t type, const storage_manager& src, storage_manager& dst) {
+    static thread_local unique_ptr<libdeflate_decompressor, deflate_free> d;
+    if (!d)
+        d.reset(libdeflate_alloc_decompressor());
+    if (!d)
+        return false;
+    size_t size = 0;
+    libdeflate_result res;
+    if (ZIP_GZIP == type)
+        res = libdeflate_gzip_decompress(d.get(), src.buffer, src.size, dst.buffer, dst.size, &size);
+    else if (ZIP_ZLIB == type)
+        res = libdeflate_zlib_decompress(d.get(), src.buffer, src.size, dst.buffer, dst.size, &size);
+    else
+        res = libdeflate_deflate_decompress(d.get(), src.buffer, src.size, dst.buffer, dst.size, &size);
+    if (LIBDEFLATE_INSUFFICIENT_SPACE == res)
+        dst.size = static_cast<size_t>(-1);
+    if (LIBDEFLATE_SUCCESS != res)
+        return false;
+    dst.size = size;
+    return true;
+}
+
+#else
+
+// Mostly copied from mrf_util.cpp:ZUnPack()
+static bool inflate_buffer(zip_t type, const storage_manager& src, storage_manager& dst) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    stream.next_in = reinterpret_cast<Bytef*>(src.buffer);
+    stream.avail_in = static_cast<uInt>(src.size);
+    stream.next_out = reinterpret_cast<Bytef*>(dst.buffer);
+    stream.avail_out = static_cast<uInt>(dst.size);
+
+    // Max window size, the header selects the format
+    int bits = (ZIP_GZIP == type) ? 16 + MAX_WBITS : (ZIP_ZLIB == type) ? MAX_WBITS : -MAX_WBITS;
+    if (Z_OK != inflateInit2(&stream, bits))
+        return false;
+    auto err = inflate(&stream, Z_FINISH);
+
+    // Use dst.size as flag, that buffer was too small
+    if (Z_BUF_ERROR == err)
+        dst.size = static_cast<size_t>(-1);
+
+    if (Z_STREAM_END != err) {
+        inflateEnd(&stream);
+        return false;
+    }
+
+    dst.size = stream.total_out;
+    return Z_OK == inflateEnd(&stream);
+}
+
+#endif
+
+#if defined(HAVE_ZSTD)
+
+struct zstd_free {
+    void operator()(ZSTD_DCtx* ctx) const { ZSTD_freeDCtx(ctx); }
+};
+
+static bool zstd_buffer(const storage_manager& src, storage_manager& dst) {
+    static thread_local unique_ptr<ZSTD_DCtx, zstd_free> ctx;
+    if (!ctx)
+        ctx.reset(ZSTD_createDCtx());
+    if (!ctx)
+        return false;
+    size_t size = ZSTD_decompressDCtx(ctx.get(), dst.buffer, dst.size, src.buffer, src.size);
+    if (ZSTD_isError(size)) {
+        if (ZSTD_error_dstSize_tooSmall == ZSTD_getErrorCode(size))
+            dst.size = static_cast<size_t>(-1);
+        return false;
+    }
+    dst.size = size;
+    return true;
+}
+
+#endif
+
+bool unzip(zip_t type, const storage_manager& src, storage_manager& dst) {
+    switch (type) {
+    case ZIP_GZIP:
+    case ZIP_ZLIB:
+    case ZIP_DEFLATE:
+        return inflate_buffer(type, src, dst);
+#if defined(HAVE_ZSTD)
+    case ZIP_ZSTD:
+        return zstd_buffer(src, dst);
+#endif
+    default:
+        return false;
+    }
+}
+
+NS_AHTSE_END
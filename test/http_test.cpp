@@ -0,0 +1,168 @@
+/*
+* http_test.cpp
+*
+* Tests of the direct HTTP client against a loopback server
+* Chunked bodies, keep-alive connection reuse and the retry on a stale connection
+*
+* (C) Lucian Plesea 2019-2021
+*
+*/
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "ahtse.h"
+#include <apr_general.h>
+#include <cstdio>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+using namespace std;
+NS_ICD_USE
+NS_AHTSE_USE
+
+// Part of the httpd binary, not of a library
+int ap_cstr_casecmpn(const char* s1, const char* s2, apr_size_t n) {
+    return strncasecmp(s1, s2, n);
+}
+
+static atomic<int> connections(0);
+static int failures = 0;
+
+#define CHECK(cond) if (!(cond)) { printf("FAIL %s:%d %s\n", __FILE__, __LINE__, #cond); failures++; }
+
+// Large chunked body, with chunks which cross the client receive buffer
+static string big_body() {
+    string body;
+    for (int i = 0; body.size() < 100000; i++)
+        body.append(to_string(i)).append(" ");
+    return body;
+}
+
+static bool send_all(int fd, const string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        sent += n;
+    }
+    return true;
+}
+
+static string chunked(const string& body, size_t csize) {
+    string out;
+    char line[32];
+    for (size_t i = 0; i < body.size(); i += csize) {
+        string chunk = body.substr(i, csize);
+        snprintf(line, sizeof(line), "%zx;ext=1\r\n", chunk.size());
+        out.append(line).append(chunk).append("\r\n");
+    }
+    return out.append("0\r\nX-Trailer: done\r\n\r\n");
+}
+
+// Serves requests on one connection until the client or the response closes it
+static void serve(int fd) {
+    string in;
+    char buffer[4096];
+    for (;;) {
+        size_t end;
+        while (string::npos == (end = in.find("\r\n\r\n"))) {
+            ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n <= 0) {
+                close(fd);
+                return;
+            }
+            in.append(buffer, n);
+        }
+        string request = in.substr(0, end);
+        in.erase(0, end + 4);
+        string path = request.substr(4, request.find(' ', 4) - 4);
+
+        string head("HTTP/1.1 200 OK\r\n"), body;
+        bool drop = false;
+        if ("/chunked" == path) {
+            body = chunked("Hello, chunked world", 7);
+            head.append("Transfer-Encoding: chunked\r\n\r\n");
+        }
+        else if ("/big" == path) {
+            body = chunked(big_body(), 7000);
+            head.append("Transfer-Encoding: chunked\r\n\r\n");
+        }
+        else {
+            body = "keep-alive";
+            head.append("Content-Length: 10\r\n\r\n");
+            // Closed after the response, without telling the client
+            drop = ("/drop" == path);
+        }
+        if (!send_all(fd, head + body) || drop) {
+            close(fd);
+            return;
+        }
+    }
+}
+
+static void server(int lfd) {
+    int fd;
+    while ((fd = accept(lfd, nullptr, nullptr)) >= 0) {
+        connections++;
+        thread(serve, fd).detach();
+    }
+}
+
+static string get(const string& url, int& status) {
+    static vector<char> buffer(256 * 1024);
+    storage_manager dst(buffer.data(), buffer.size());
+    http_result_t result;
+    const char* msg = nullptr;
+    apr_status_t stat = http_get(url.c_str(), dst, result, nullptr, &msg);
+    status = (APR_SUCCESS == stat) ? result.status : -1;
+    if (APR_SUCCESS != stat)
+        printf("%s failed, %s\n", url.c_str(), msg ? msg : "no message");
+    return string(buffer.data(), APR_SUCCESS == stat ? dst.size : 0);
+}
+
+int main() {
+    apr_initialize();
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(lfd, reinterpret_cast<sockaddr*>(&addr), len) || listen(lfd, 16)
+        || getsockname(lfd, reinterpret_cast<sockaddr*>(&addr), &len))
+    {
+        printf("Can't start the server\n");
+        return 1;
+    }
+    thread(server, lfd).detach();
+    string base = "http://127.0.0.1:" + to_string(ntohs(addr.sin_port));
+    int status;
+
+    // Chunked, with extensions and a trailer
+    CHECK(get(base + "/chunked", status) == "Hello, chunked world");
+    CHECK(200 == status);
+    CHECK(get(base + "/big", status) == big_body());
+    CHECK(200 == status);
+
+    // Keep-alive, the connection is reused
+    int before = connections;
+    CHECK(get(base + "/ka", status) == "keep-alive");
+    CHECK(get(base + "/ka", status) == "keep-alive");
+    CHECK(connections == before);
+
+    // The server closes the idle connection, the next request retries on a new one
+    CHECK(get(base + "/drop", status) == "keep-alive");
+    this_thread::sleep_for(chrono::milliseconds(50));
+    before = connections;
+    CHECK(get(base + "/ka", status) == "keep-alive");
+    CHECK(200 == status);
+    CHECK(connections == before + 1);
+
+    printf(failures ? "%d failures\n" : "All passed\n", failures);
+    shutdown(lfd, SHUT_RDWR);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,166 @@
+/*
+* pixel_test.cpp
+*
+* Checks that the SIMD pixel kernels match the scalar ones, value for value
+* With the bench argument, also measures both
+*
+* (C) Lucian Plesea 2019-2021
+*
+*/
+
+#include "ahtse_common.h"
+#include <cstdio>
+#include <cmath>
+#include <limits>
+#include <chrono>
+#include <random>
+
+using namespace std;
+NS_ICD_USE
+NS_AHTSE_USE
+
+#define PT_SIZE 512
+#define PT_BANDS 3
+#define PT_REPEAT 50
+
+static int failures = 0;
+static char sname[96];
+
+static TiledRaster make_raster(ICDDataType dt, int has_ndv, double ndv) {
+    TiledRaster raster = TiledRaster();
+    raster.dt = dt;
+    raster.pagesize.x = raster.pagesize.y = PT_SIZE;
+    raster.pagesize.z = 1;
+    raster.pagesize.c = PT_BANDS;
+    raster.size = raster.pagesize;
+    raster.has_ndv = has_ndv;
+    raster.ndv = ndv;
+    // Scaling by one, the ties are kept
+    if (ICDT_Float32 == dt) {
+        raster.has_min = raster.has_max = 1;
+        raster.max = 255;
+    }
+    return raster;
+}
+
+// Random values, with the edge cases mixed in
+static vector<uint8_t> make_page(ICDDataType dt, double ndv) {
+    size_t count = PT_SIZE * PT_SIZE * PT_BANDS;
+    vector<uint8_t> page(count * getTypeSize(dt));
+    mt19937 gen(42);
+    uniform_int_distribution<int> bytes(0, 255), pick(0, 15);
+    uniform_real_distribution<float> reals(-50, 300);
+    const float specials[] = { numeric_limits<float>::quiet_NaN(), numeric_limits<float>::infinity(),
+        -numeric_limits<float>::infinity(), 0.5f, 254.5f, 0.0f, 1.0f, 127.5f,
+        65535.5f, -0.5f, 255.5f, static_cast<float>(ndv) };
+    for (size_t i = 0; i < count; i++) {
+        if (ICDT_Float32 == dt) {
+            float v = reals(gen);
+            if (0 == pick(gen))
+                v = specials[bytes(gen) % (sizeof(specials) / sizeof(*specials))];
+            else if (1 == pick(gen)) // Ties
+                v = static_cast<float>(bytes(gen) * ((i & 1) ? 1 : 257)) + 0.5f;
+            memcpy(&page[i * sizeof(float)], &v, sizeof(v));
+        }
+        else {
+            for (int j = 0; j < getTypeSize(dt); j++)
+                page[i * getTypeSize(dt) + j] = static_cast<uint8_t>(bytes(gen));
+            if (0 == pick(gen))
+                convert_values(&ndv, ICDT_Float64, &page[i * getTypeSize(dt)], dt, 1);
+        }
+    }
+    return page;
+}
+
+static void check(const char* name, const vector<uint8_t>& scalar, const vector<uint8_t>& simd) {
+    if (scalar == simd)
+        return;
+    size_t i = 0;
+    while (scalar[i] == simd[i])
+        i++;
+    printf("FAIL %s, first difference at byte %zu\n", name, i);
+    failures++;
+}
+
+// Runs f with the scalar code and with each SIMD level, the outputs have to match
+// Levels the CPU doesn't support run the best one it has
+template<typename F> static void compare(const char* name, size_t out_size, F f, bool bench) {
+    vector<uint8_t> scalar(out_size), simd(out_size);
+    set_simd_limit(0);
+    f(scalar.data());
+    set_simd_limit(1);
+    f(simd.data());
+    snprintf(sname, sizeof(sname), "%s SSE4.1", name);
+    check(sname, scalar, simd);
+    set_simd_limit(2);
+    f(simd.data());
+    snprintf(sname, sizeof(sname), "%s AVX2", name);
+    check(sname, scalar, simd);
+    if (!bench)
+        return;
+
+    double ms[3];
+    for (int level = 0; level < 3; level++) {
+        set_simd_limit(level);
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < PT_REPEAT; i++)
+            f(level ? simd.data() : scalar.data());
+        ms[level] = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count()
+            / PT_REPEAT;
+    }
+    set_simd_limit(2);
+    printf("%-28s scalar %8.3f ms  sse4.1 %8.3f ms %5.2fx  avx2 %8.3f ms %5.2fx\n", name,
+        ms[0], ms[1], ms[0] / ms[1], ms[2], ms[0] / ms[2]);
+}
+
+int main(int argc, char** argv) {
+    bool bench = argc > 1 && !strcmp(argv[1], "bench");
+    const size_t count = PT_SIZE * PT_SIZE * PT_BANDS;
+    const ICDDataType types[] = { ICDT_Byte, ICDT_UInt16, ICDT_Int16, ICDT_Float32 };
+    const char* names[] = { "Byte", "UInt16", "Int16", "Float32" };
+    char name[64];
+
+    for (int has_ndv = 0; has_ndv < 2; has_ndv++) {
+        for (double ndv : { 0.0, 255.0, numeric_limits<double>::quiet_NaN() }) {
+            for (size_t t = 0; t < sizeof(types) / sizeof(*types); t++) {
+                // NaN is only a NoData value for floating point
+                if (ndv != ndv && ICDT_Float32 != types[t])
+                    continue;
+                TiledRaster raster = make_raster(types[t], has_ndv, ndv);
+                vector<uint8_t> page = make_page(types[t], ndv);
+                bool report = bench && has_ndv && 0 == ndv;
+
+                snprintf(name, sizeof(name), "ndv_mask %s", names[t]);
+                compare(name, count, [&](uint8_t* out) { ndv_mask(raster, page.data(), out); },
+                    report);
+                snprintf(name, sizeof(name), "scale_to_byte %s", names[t]);
+                compare(name, count, [&](uint8_t* out) {
+                    scale_to_byte(raster, page.data(), out);
+                }, report);
+                snprintf(name, sizeof(name), "reduce_2x2 %s", names[t]);
+                compare(name, count / 4 * getTypeSize(types[t]), [&](uint8_t* out) {
+                    reduce_2x2(raster, page.data(), out, PT_SIZE / 2 * PT_BANDS, PT_SIZE / 2,
+                        PT_SIZE / 2, REDUCE_AVG);
+                }, report);
+                snprintf(name, sizeof(name), "is_empty_page %s", names[t]);
+                compare(name, 1, [&](uint8_t* out) {
+                    *out = static_cast<uint8_t>(is_empty_page(raster, page.data()));
+                }, report);
+                if (has_ndv)
+                    continue;
+
+                for (size_t d = 0; d < sizeof(types) / sizeof(*types); d++) {
+                    if (d == t)
+                        continue;
+                    snprintf(name, sizeof(name), "convert %s to %s", names[t], names[d]);
+                    compare(name, count * getTypeSize(types[d]), [&](uint8_t* out) {
+                        convert_values(page.data(), types[t], out, types[d], count);
+                    }, bench && 0 == ndv);
+                }
+            }
+        }
+    }
+
+    printf(failures ? "%d failures\n" : "All passed\n", failures);
+    return failures ? 1 : 0;
+}